@@ -33,5 +33,9 @@
 #include "memory.hpp"
 #include "alignment.hpp"
 #include "queue.hpp"
+#include "compress.hpp"
+#include "hash.hpp"
+#include "pattern.hpp"
+#include "ioengine.hpp"
 
 //~
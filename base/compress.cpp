@@ -0,0 +1,394 @@
+#include "compress.hpp"
+#include "string.hpp"
+#include "lz4.h"
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace granite { namespace base {
+
+namespace {
+const uint32 maxBlockSize = 64 * 1024 * 1024;
+
+// lz4 block format limits
+const size_t minMatch = 4;
+const size_t lastLiterals = 5; // last bytes are always literals
+const size_t matchStartLimit = 12; // matches can not start in last bytes
+const size_t maxDistance = 65535;
+const size_t maxDictionarySize = 64 * 1024;
+const int hashLog = 15;
+
+uint32 _read32(const uint8 *p) {
+    uint32 v;
+    memcpy(&v, p, sizeof(uint32));
+    return v;
+}
+
+uint32 _hash4(const uint8 *p) {
+    return (_read32(p) * 2654435761U) >> (32 - hashLog);
+}
+
+// writes lz4 sequence (literals and match, matchLength is 0 for last literals), returns false if output is full
+bool _writeSequence(uint8 *&op, const uint8 *oend, const uint8 *literals, size_t literalsLength, size_t offset, size_t matchLength) {
+    size_t ml = matchLength > 0 ? matchLength - minMatch : 0;
+    size_t need = 1 + literalsLength + (literalsLength >= 15 ? (literalsLength - 15) / 255 + 1 : 0) +
+                  (matchLength > 0 ? 2 + (ml >= 15 ? (ml - 15) / 255 + 1 : 0) : 0);
+    if ((size_t)(oend - op) < need)
+        return false;
+
+    auto writeLength = [&op](size_t length) {
+        for (; length >= 255; length -= 255)
+            *op++ = 255;
+        *op++ = (uint8)length;
+    };
+    uint8 *token = op++;
+    *token = (uint8)((std::min<size_t>(literalsLength, 15) << 4) | std::min<size_t>(ml, 15));
+    if (literalsLength >= 15)
+        writeLength(literalsLength - 15);
+    memcpy(op, literals, literalsLength);
+    op += literalsLength;
+    if (matchLength > 0) {
+        *op++ = (uint8)offset;
+        *op++ = (uint8)(offset >> 8);
+        if (ml >= 15)
+            writeLength(ml - 15);
+    }
+    return true;
+}
+
+// hash chain compressor, source starts at base + dictSize (dictionary is prefix of source)
+int _compressHC(const uint8 *base, size_t dictSize, size_t srcSize, uint8 *dst, size_t dstCapacity, int level) {
+    const uint8 *src = base + dictSize;
+    const uint8 *iend = src + srcSize;
+    const uint8 *anchor = src;
+    uint8 *op = dst;
+    const uint8 *oend = dst + dstCapacity;
+
+    if (srcSize > matchStartLimit) {
+        const uint8 *startLimit = iend - matchStartLimit;
+        const uint8 *matchLimit = iend - lastLiterals;
+        std::vector<int32> head(1 << hashLog, -1);
+        std::vector<uint16> chain(maxDistance + 1, 0); // distance to previous position with same hash (0 - none)
+        size_t inserted = 0;
+        int attempts = std::min(4 << std::min(level, 12), 4096);
+
+        // longest match for ip (positions before ip are inserted to chains first)
+        auto find = [&](const uint8 *ip, const uint8 *&match) -> size_t {
+            for (size_t pos = ip - base; inserted < pos; ++inserted) {
+                uint32 h = _hash4(base + inserted);
+                size_t distance = head[h] < 0 ? 0 : inserted - head[h];
+                chain[inserted & maxDistance] = (uint16)(distance > maxDistance ? 0 : distance);
+                head[h] = (int32)inserted;
+            }
+
+            size_t best = 0;
+            size_t pos = ip - base;
+            int32 p = head[_hash4(ip)];
+            for (int n = 0; p >= 0 && n < attempts && pos - p <= maxDistance; ++n) {
+                const uint8 *m = base + p;
+                if (m[best] == ip[best] && _read32(m) == _read32(ip)) {
+                    size_t length = minMatch;
+                    while (ip + length < matchLimit && m[length] == ip[length])
+                        ++length;
+                    if (length > best) {
+                        best = length;
+                        match = m;
+                        if (ip + best == matchLimit)
+                            break;
+                    }
+                }
+                uint16 d = chain[p & maxDistance];
+                if (d == 0)
+                    break;
+                p -= d;
+            }
+            return best;
+        };
+
+        const uint8 *ip = src;
+        size_t misses = 0;
+        while (ip < startLimit) {
+            const uint8 *match = nullptr;
+            size_t length = find(ip, match);
+            if (length < minMatch) {
+                ip += 1 + (misses++ >> 6); // skip faster through incompressible data
+                continue;
+            }
+            misses = 0;
+
+            // lazy matching - longer match at next position wins
+            while (ip + 1 < startLimit) {
+                const uint8 *nextMatch = nullptr;
+                size_t nextLength = find(ip + 1, nextMatch);
+                if (nextLength <= length)
+                    break;
+                ++ip;
+                match = nextMatch;
+                length = nextLength;
+            }
+
+            if (!_writeSequence(op, oend, anchor, ip - anchor, ip - match, length))
+                return 0;
+            ip += length;
+            anchor = ip;
+        }
+    }
+
+    if (!_writeSequence(op, oend, anchor, iend - anchor, 0, 0))
+        return 0;
+    return (int)(op - dst);
+}
+}
+
+//- block compression
+int lz4CompressBlock(const void *src, int srcSize, void *dst, int dstCapacity, int level, const void *dict, int dictSize) {
+    if (dict == nullptr || dictSize <= 0) {
+        dictSize = 0;
+        if (level <= 0)
+            return std::max(0, LZ4_compress_default((const char*)src, (char*)dst, srcSize, dstCapacity));
+        return _compressHC((const uint8*)src, 0, srcSize, (uint8*)dst, dstCapacity, level);
+    }
+
+    // only last 64KB of dictionary is reachable
+    if ((size_t)dictSize > maxDictionarySize) {
+        dict = (const uint8*)dict + dictSize - maxDictionarySize;
+        dictSize = (int)maxDictionarySize;
+    }
+    if (level <= 0) {
+        LZ4_stream_t *state = LZ4_createStream();
+        LZ4_loadDict(state, (const char*)dict, dictSize);
+        int r = LZ4_compress_fast_continue(state, (const char*)src, (char*)dst, srcSize, dstCapacity, 1);
+        LZ4_freeStream(state);
+        return std::max(0, r);
+    }
+
+    // matches may reach to dictionary, keep it in front of source
+    std::vector<uint8> prefixed(dictSize + srcSize);
+    memcpy(prefixed.data(), dict, dictSize);
+    memcpy(prefixed.data() + dictSize, src, srcSize);
+    return _compressHC(prefixed.data(), dictSize, srcSize, (uint8*)dst, dstCapacity, level);
+}
+
+stream lz4TrainDictionary(const std::vector<stream> &samples, size_t size) {
+    const size_t kmer = 8; // scored substring length
+    const size_t segment = 64; // dictionary piece length
+    const size_t step = 16; // candidate segments stride
+    auto kmerHash = [](const uint8 *p) {
+        uint64 v;
+        memcpy(&v, p, sizeof(uint64));
+        return v * 0x9E3779B97F4A7C15ULL;
+    };
+
+    // in how many samples every k-mer appears
+    std::unordered_map<uint64, uint32> frequency;
+    for (const auto &s : samples) {
+        std::unordered_set<uint64> seen;
+        for (size_t i = 0; i + kmer <= s.size(); ++i)
+            seen.insert(kmerHash(s.data() + i));
+        for (uint64 h : seen)
+            ++frequency[h];
+    }
+
+    // segment score is sum of frequencies of its k-mers shared by at least two samples (k-mers are counted once)
+    auto score = [&](const uint8 *p) {
+        uint64 r = 0;
+        for (size_t i = 0; i + kmer <= segment; ++i) {
+            auto f = frequency.find(kmerHash(p + i));
+            if (f != frequency.end() && f->second > 1)
+                r += f->second;
+        }
+        return r;
+    };
+
+    // lazy greedy selection (scores only decrease after selected k-mers are cleared)
+    typedef std::tuple<uint64, size_t, size_t> candidate; // <score, sample, offset>
+    std::priority_queue<candidate> queue;
+    for (size_t i = 0; i < samples.size(); ++i) {
+        for (size_t o = 0; o + segment <= samples[i].size(); o += step) {
+            uint64 sc = score(samples[i].data() + o);
+            if (sc > 0)
+                queue.push(std::make_tuple(sc, i, o));
+        }
+    }
+
+    std::vector<const uint8*> selected;
+    while (!queue.empty() && selected.size() * segment + segment <= size) {
+        candidate c = queue.top();
+        queue.pop();
+        const uint8 *p = samples[std::get<1>(c)].data() + std::get<2>(c);
+        uint64 sc = score(p);
+        if (sc == 0)
+            continue;
+        if (!queue.empty() && sc < std::get<0>(queue.top())) {
+            queue.push(std::make_tuple(sc, std::get<1>(c), std::get<2>(c)));
+            continue;
+        }
+        selected.push_back(p);
+        for (size_t i = 0; i + kmer <= segment; ++i)
+            frequency.erase(kmerHash(p + i));
+    }
+
+    // best segments at the end (closest to compressed data)
+    stream r;
+    for (auto i = selected.rbegin(); i != selected.rend(); ++i)
+        r.write(*i, segment);
+    r.setPosFromBegin(0);
+    return r;
+}
+
+//- writer
+lz4_writer::lz4_writer(sink out, size_t blockSize)
+    : _out(out), _blockSize(std::min<size_t>(std::max<size_t>(blockSize, 1024), maxBlockSize)),
+      _state(LZ4_createStream()), _block(0), _fill(0), _bytesIn(0), _bytesOut(0),
+      _header(false), _failed(false) {
+    _in.resize(_blockSize * 2);
+    _compressed.resize(LZ4_compressBound((int)_blockSize));
+}
+
+lz4_writer::~lz4_writer() {
+    LZ4_freeStream((LZ4_stream_t*)_state);
+}
+
+bool lz4_writer::_emit(const void *data, size_t size) {
+    if (!_failed && !_out(data, size))
+        _failed = true;
+    _bytesOut += size;
+    return !_failed;
+}
+
+bool lz4_writer::_flushBlock() {
+    if (!_header) {
+        uint32 bs = (uint32)_blockSize;
+        _header = true;
+        if (!_emit(&bs, sizeof(bs)))
+            return false;
+    }
+    if (_fill == 0)
+        return !_failed;
+
+    int size = LZ4_compress_fast_continue((LZ4_stream_t*)_state, &_in[_block * _blockSize], _compressed.data(),
+                                          (int)_fill, (int)_compressed.size(), 1);
+    uint32 csize = (uint32)size;
+    if (size <= 0 || !_emit(&csize, sizeof(csize)) || !_emit(_compressed.data(), csize)) {
+        _failed = true;
+        return false;
+    }
+
+    // switch buffers, previous block stays untouched as dictionary
+    _block ^= 1;
+    _fill = 0;
+    return true;
+}
+
+bool lz4_writer::write(const void *data, size_t size) {
+    const char *src = (const char*)data;
+    _bytesIn += size;
+    while (size > 0 && !_failed) {
+        size_t n = std::min(size, _blockSize - _fill);
+        memcpy(&_in[_block * _blockSize + _fill], src, n);
+        _fill += n;
+        src += n;
+        size -= n;
+        if (_fill == _blockSize)
+            _flushBlock();
+    }
+    return !_failed;
+}
+
+bool lz4_writer::finish() {
+    uint32 endMark = 0;
+    return _flushBlock() && _emit(&endMark, sizeof(endMark));
+}
+
+bool lz4_writer::failed() const { return _failed; }
+uint64 lz4_writer::bytesIn() const { return _bytesIn; }
+uint64 lz4_writer::bytesOut() const { return _bytesOut; }
+
+//- reader
+lz4_reader::lz4_reader(source in)
+    : _in(in), _blockSize(0), _state(LZ4_createStreamDecode()), _block(1), _pos(0), _size(0),
+      _header(false), _end(false), _failed(false) { }
+
+lz4_reader::~lz4_reader() {
+    LZ4_freeStreamDecode((LZ4_streamDecode_t*)_state);
+}
+
+void lz4_reader::reset(source in) {
+    _in = in;
+    _block = 1;
+    _pos = _size = 0;
+    _header = _end = _failed = false;
+    LZ4_setStreamDecode((LZ4_streamDecode_t*)_state, NULL, 0);
+}
+
+bool lz4_reader::_fetch(void *data, size_t size) {
+    if (_in(data, size) != size) {
+        logError("lz4 reader: unexpected end of data");
+        _failed = true;
+    }
+    return !_failed;
+}
+
+bool lz4_reader::_nextBlock() {
+    if (!_header) {
+        uint32 bs;
+        if (!_fetch(&bs, sizeof(bs)))
+            return false;
+        if (bs == 0 || bs > maxBlockSize) {
+            logError(strs("lz4 reader: invalid block size: ", bs));
+            _failed = true;
+            return false;
+        }
+        _blockSize = bs;
+        _out.resize(_blockSize * 2);
+        _compressed.resize(LZ4_compressBound((int)_blockSize));
+        _header = true;
+    }
+
+    uint32 csize;
+    if (!_fetch(&csize, sizeof(csize)))
+        return false;
+    if (csize == 0) {
+        _end = true;
+        return false;
+    }
+    if (csize > _compressed.size()) {
+        logError("lz4 reader: corrupted block");
+        _failed = true;
+        return false;
+    }
+    if (!_fetch(_compressed.data(), csize))
+        return false;
+
+    // decode to other buffer, current one is dictionary
+    _block ^= 1;
+    int size = LZ4_decompress_safe_continue((LZ4_streamDecode_t*)_state, _compressed.data(), &_out[_block * _blockSize],
+                                            (int)csize, (int)_blockSize);
+    if (size < 0) {
+        logError("lz4 reader: could not decompress block");
+        _failed = true;
+        return false;
+    }
+    _pos = 0;
+    _size = size;
+    return true;
+}
+
+size_t lz4_reader::read(void *data, size_t size) {
+    char *dst = (char*)data;
+    size_t r = 0;
+    while (r < size) {
+        if (_pos == _size && (_end || _failed || !_nextBlock()))
+            break;
+        size_t n = std::min(size - r, _size - _pos);
+        memcpy(dst + r, &_out[_block * _blockSize + _pos], n);
+        _pos += n;
+        r += n;
+    }
+    return r;
+}
+
+bool lz4_reader::eof() const { return _end && _pos == _size; }
+bool lz4_reader::failed() const { return _failed; }
+
+}}
@@ -0,0 +1,98 @@
+/*
+ * granite engine 1.0 | 2006-2026 | Jakub Duracz | jakubduracz@gmail.com | http://jakubduracz.com
+ * file: compress
+ * created: 19-10-2026
+ *
+ * description: LZ4 streaming compression adapters, block compression levels and dictionaries
+ *
+ * changelog:
+ * - 19-10-2026: file created
+ */
+
+#pragma once
+#include "includes.hpp"
+#include "stream.hpp"
+
+namespace granite { namespace base {
+
+/* lz4 frame structure
+uint32 blockSize; // uncompressed size of every block (last one may be shorter)
+< for each block (block-linked, previous block is dictionary for next one):
+uint32 compressedSize;
+uint8 data[compressedSize];
+>
+uint32 endMark; // 0
+*/
+
+// compress lz4 block, returns compressed size (0 if failed), output is standard lz4 block so decompression speed
+// does not depend on level, level 0 - lz4 fast, 1-12 - hash chain match search (slower, better ratio),
+// dictionary (last 64KB are used) must be passed to LZ4_decompress_safe_usingDict too
+int lz4CompressBlock(const void *src, int srcSize, void *dst, int dstCapacity, int level = 0, const void *dict = nullptr, int dictSize = 0);
+
+// builds dictionary for many small similar files (segments shared by most samples, most useful at the end)
+stream lz4TrainDictionary(const std::vector<stream> &samples, size_t size = 64 * 1024);
+
+// compresses written data block by block, passes frame to sink
+class lz4_writer {
+public:
+    typedef std::function<bool(const void *, size_t)> sink;
+
+private:
+    sink _out;
+    size_t _blockSize;
+    void *_state;
+    std::vector<char> _in; // two blocks, previous one must stay in memory
+    std::vector<char> _compressed;
+    size_t _block; // current block in _in (0 or 1)
+    size_t _fill; // bytes in current block
+    uint64 _bytesIn, _bytesOut;
+    bool _header, _failed;
+
+    bool _emit(const void *data, size_t size);
+    bool _flushBlock();
+
+public:
+    lz4_writer(sink out, size_t blockSize = 64 * 1024);
+    ~lz4_writer();
+    lz4_writer(const lz4_writer &) = delete;
+    lz4_writer &operator=(const lz4_writer &) = delete;
+
+    bool write(const void *data, size_t size);
+    bool finish(); //!< compresses buffered data and writes end mark
+    bool failed() const;
+    uint64 bytesIn() const;
+    uint64 bytesOut() const;
+};
+
+// decompresses frame pulled from source block by block
+class lz4_reader {
+public:
+    typedef std::function<size_t(void *, size_t)> source; //!< returns bytes read
+
+private:
+    source _in;
+    size_t _blockSize;
+    void *_state;
+    std::vector<char> _out; // two blocks, previous one is dictionary for current
+    std::vector<char> _compressed;
+    size_t _block; // current block in _out (0 or 1)
+    size_t _pos, _size; // read position / size of current block
+    bool _header, _end, _failed;
+
+    bool _fetch(void *data, size_t size);
+    bool _nextBlock();
+
+public:
+    lz4_reader(source in);
+    ~lz4_reader();
+    lz4_reader(const lz4_reader &) = delete;
+    lz4_reader &operator=(const lz4_reader &) = delete;
+
+    void reset(source in); //!< starts reading new frame, buffers are reused
+
+    size_t read(void *data, size_t size); //!< returns bytes read, less than size at the end of frame or on error
+    bool eof() const;
+    bool failed() const;
+};
+
+}}
@@ -1,11 +1,22 @@
 #include "fs.hpp"
 #include "string.hpp"
 #include "gstdlib.hpp"
+#include "compress.hpp"
+#include "hash.hpp"
+#include "ioengine.hpp"
+#include "pattern.hpp"
+#include "queue.hpp"
 #include "lz4.h"
 
-#include <regex>
 #include <thread>
 #include <condition_variable>
+#include <shared_mutex>
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
 #include <sys/stat.h>
 #include <sys/types.h>
 #ifdef GE_COMPILER_VISUAL
@@ -14,9 +25,14 @@
 #include <io.h>
 #elif defined(GE_COMPILER_GCC) && defined(GE_PLATFORM_LINUX)
 #include <unistd.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <dirent.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #elif defined(GE_COMPILER_GCC)
 #include <unistd.h>
 #include <dirent.h>
@@ -29,7 +45,23 @@ namespace {
 string _dirProgramData, _dirUser, _dirWorkingDir;
 bool _preferVFS = false;
 bool _allowGlobal = true;
+bool _verifyChecksums = true;
+bool _mapArchives = false;
+bool _deduplicate = false;
+bool _journal = false;
+size_t _mapThreshold = 8 * 1024 * 1024;
 std::vector<string> _doNotCompress = {"png", "jpg", "ogg", "mp3", "zip", "7z", "rar", "gfs", "flac"};
+const size_t _frameThreshold = 4 * 1024 * 1024; // bigger files are compressed as lz4 frames (bounded memory)
+const size_t _frameBlockSize = 256 * 1024;
+const uint32 _blockCrcs = 0x80000000; // blocksCount flag of block table
+std::atomic<uint64> _tempCounter(0); // unique temporary file names
+
+// compression settings per extension ("" - default)
+struct compression_profile {
+    int level; // 0 - lz4 fast, 1-12 - lz4 hc
+    bool dictionary; // small files use archive dictionary
+};
+std::map<string, compression_profile> _compressionProfiles = {{"", {0, false}}};
 
 const char *directoryTypeToStr(directoryType type) {
     if (type == userData)
@@ -93,6 +125,7 @@ bool _exists_file(const string &file) {
 
 // resize given file
 void _resize(std::FILE *f, size_t newSize) {
+    std::fflush(f);
     #ifdef GE_COMPILER_VISUAL
     _chsize_s(_fileno(f), newSize);
     #else
@@ -103,6 +136,126 @@ void _resize(std::FILE *f, size_t newSize) {
     #endif
 }
 
+// map whole file to memory (private, pages are copied on write), returns false if failed
+bool _map(const string &path, stream &s) {
+    #ifdef GE_PLATFORM_WINDOWS
+    HANDLE f = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (f == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    HANDLE m = NULL;
+    if (GetFileSizeEx(f, &size) && size.QuadPart > 0)
+        m = CreateFileMapping(f, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    CloseHandle(f);
+    if (m == NULL)
+        return false;
+    void *p = MapViewOfFile(m, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(m);
+    if (p == NULL)
+        return false;
+    s = stream((uint8*)p, (size_t)size.QuadPart, std::shared_ptr<void>(p, [](void *mem) { UnmapViewOfFile(mem); }));
+    return true;
+    #else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return false;
+
+    // consumers usually read whole file front to back
+    size_t size = st.st_size;
+    madvise(p, size, MADV_SEQUENTIAL);
+    madvise(p, size, MADV_WILLNEED);
+    s = stream((uint8*)p, size, std::shared_ptr<void>(p, [size](void *mem) { munmap(mem, size); }));
+    return true;
+    #endif
+}
+
+// map whole opened file read only (shared - later writes to file are visible), returns empty pointer if failed
+std::shared_ptr<const_stream> _mapShared(std::FILE *f) {
+    std::fflush(f);
+    #ifdef GE_PLATFORM_WINDOWS
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(f));
+    LARGE_INTEGER size;
+    HANDLE m = NULL;
+    if (GetFileSizeEx(h, &size) && size.QuadPart > 0)
+        m = CreateFileMapping(h, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m == NULL)
+        return nullptr;
+    void *p = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(m);
+    if (p == NULL)
+        return nullptr;
+    return std::shared_ptr<const_stream>(new const_stream(p, (size_t)size.QuadPart), [](const_stream *c) {
+        UnmapViewOfFile(c->data());
+        delete c;
+    });
+    #else
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fileno(f), &st) == 0 && st.st_size > 0)
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+    return std::shared_ptr<const_stream>(new const_stream(p, st.st_size), [](const_stream *c) {
+        munmap((void*)c->data(), c->size());
+        delete c;
+    });
+    #endif
+}
+
+// descriptor of opened file
+int _fd(std::FILE *f) {
+    #ifdef GE_COMPILER_VISUAL
+    return _fileno(f);
+    #else
+    return fileno(f);
+    #endif
+}
+
+// flush file to storage device
+bool _sync(std::FILE *f) {
+    if (0 != std::fflush(f))
+        return false;
+    #ifdef GE_COMPILER_VISUAL
+    return 0 == _commit(_fd(f));
+    #elif defined(GE_PLATFORM_LINUX)
+    return 0 == fdatasync(_fd(f)); // size is synced too, other metadata is not needed
+    #else
+    return 0 == fsync(_fd(f));
+    #endif
+}
+
+// unique temporary file name next to given file
+string _tempPath(const string &path) {
+    #ifdef GE_PLATFORM_WINDOWS
+    uint64 pid = GetCurrentProcessId();
+    #else
+    uint64 pid = getpid();
+    #endif
+    return strs(path, ".", pid, "-", _tempCounter++, ".tmp");
+}
+
+// positional read, does not use/change file position so it is safe for concurrent readers
+// (file buffers must be flushed after writes), goes through io engine of calling thread
+bool _pread(std::FILE *f, void *data, size_t size, uint64 offset) {
+    return io_engine::local().read(_fd(f), data, size, offset);
+}
+
+// write all chunks of stream to file
+bool _fwrite(std::FILE *f, const chunked_stream &s) {
+    for (const auto &c : s.gather()) {
+        if (1 != std::fwrite(c.data(), c.size(), 1, f))
+            return false;
+    }
+    return true;
+}
+
 // create directory tree, path and pathBase must be normalized
 bool _mkdirtree(const string &pathBase, const string &path) {
     string p = pathBase + GE_DIR_SEPARATOR;
@@ -125,10 +278,24 @@ bool _mkdirtree(const string &pathBase, const string &path) {
     return true;
 }
 
-// gives list of files that fullfill predicate condition (only current folder)
+#ifdef GE_PLATFORM_LINUX
+// getdents64 record
+struct linux_dirent64 {
+    uint64 d_ino;
+    int64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[256];
+};
+#endif
+
+// gives list of files that fullfill predicate condition (only current folder), sorted by name,
+// times are read for accepted files only (if times is set)
 fileList _filterFileList(const string &basePath,
                          const string &path,
-                         std::function<bool(fileInfo &)> pred = std::function<bool(fileInfo &)>()) {
+                         // sees path, name and dir flag only, times are 0 on linux (filled after predicate)
+                         std::function<bool(fileInfo &)> pred = std::function<bool(fileInfo &)>(),
+                         bool times = true) {
     fileList r;
 
     #ifdef GE_PLATFORM_WINDOWS
@@ -148,102 +315,539 @@ fileList _filterFileList(const string &basePath,
         fileInfo fi = { path,
                         fd.cFileName,
                         (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0,
-                        toUnixTime(fd.ftCreationTime),
-                        toUnixTime(fd.ftLastWriteTime) };
+                        times ? toUnixTime(fd.ftCreationTime) : 0,
+                        times ? toUnixTime(fd.ftLastWriteTime) : 0 };
         findAndReplace(fi.path, "\\", "/");
         if (!pred || pred(fi))
             r.push_back(fi);
     }
     while(FindNextFile(hf, &fd));
+    FindClose(hf);
     #elif defined(GE_PLATFORM_LINUX)
-    DIR *dir;
-    class dirent *ent;
+    int dir = ::open((basePath + path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir == -1)
+        return r;
+
+    // bulk read of entries, type comes with entry so only links and unknown types are stat'ed
     class stat st;
-    dir = opendir((basePath + path).c_str());
-    while ((ent = readdir(dir)) != NULL) {
-        if (ent->d_name[0] == '.')
-            continue;
-        if (stat((basePath + path + "/" + ent->d_name).c_str(), &st) == -1)
-            continue;
-        fileInfo fi = { path,
-                        ent->d_name,
-                        (st.st_mode & S_IFDIR) != 0,
-                        (uint64)st.st_mtime,
-                        (uint64)st.st_ctime };
-        if (!pred || pred(fi))
-            r.push_back(fi);
+    std::vector<char> buffer(32 * 1024);
+    long read;
+    while ((read = syscall(SYS_getdents64, dir, buffer.data(), buffer.size())) > 0) {
+        for (long offset = 0; offset < read;) {
+            const linux_dirent64 *ent = (const linux_dirent64 *)(buffer.data() + offset);
+            offset += ent->d_reclen;
+            if (ent->d_name[0] == '.')
+                continue;
+            bool isDir = ent->d_type == DT_DIR;
+            if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) {
+                if (fstatat(dir, ent->d_name, &st, 0) == -1)
+                    continue;
+                isDir = S_ISDIR(st.st_mode);
+            }
+            fileInfo fi = { path, ent->d_name, isDir, 0, 0 };
+            if (!pred || pred(fi))
+                r.push_back(fi);
+        }
     }
-    closedir(dir);
+
+    // lazy stat, only files passed to caller
+    if (times) {
+        for (auto &fi : r) {
+            if (fstatat(dir, fi.name.c_str(), &st, 0) == 0) {
+                fi.createTime = (uint64)st.st_mtime;
+                fi.modTime = (uint64)st.st_ctime;
+            }
+        }
+    }
+    ::close(dir);
     #else
     #error "not implemented"
     #endif
 
-    return r;
-}
-
-// same as above but recursively down in fs
-fileList _filterFileListR(const string &basePath,
-                          const string &path,
-                          std::function<bool(fileInfo &)> pred = std::function<bool(fileInfo &)>()) {
-    fileList r;
-    std::deque<string> dirToCheck = { path };
-
-    do {
-        string path = dirToCheck.front();
-        for (const auto &f : _filterFileList(basePath, path, [](fileInfo &fi) { return fi.dir; }))
-            dirToCheck.push_back(path == "" ? f.name : (path + GE_DIR_SEPARATOR + f.name));
-        append(r, _filterFileList(basePath, path, pred));
-        dirToCheck.pop_front();
-    }
-    while (!dirToCheck.empty());
+    std::sort(r.begin(), r.end(), [](const fileInfo &a, const fileInfo &b) { return a.name < b.name; });
     return r;
 }
 
 //- vfs
 /* gfs file structure
 // header
-char id[4]; // "GFS2"
-uint64 headerOffset;
+char id[4]; // "GFS4" ("GFS2" archives are still readable, index is upgraded on first write)
+uint64 indexOffset; // current index (manifest)
 
-// data
+// data (append only log - files and indices are appended, removed/moved files and old indices
+// leave holes which are reclaimed by compaction, current index is last one after compaction)
 < for each file:
-uin8 rawData[size];
+uin8 rawData[size]; // compressed: int64 realSize; uint8 lz4Block[] or lz4 frame (see compress.hpp)
 >
 
-// index
-< for each file:
+// block table (after lz4 frame with independent blocks, vfs_block_table flag)
+uint32 blockCrc[blocksCount]; // crc32c of compressed block data (after compressedSize field), if flagged in blocksCount
+uint64 blockOffset[blocksCount]; // offset of block (compressedSize field) from file data start
+uint32 blocksCount; // high bit - block checksums are stored (_blockCrcs, random reads verify touched blocks only)
+
+// index (GFS2)
 uint32 filesCount;
+< for each file:
 uint32 nameLength;
 char name[];
 uint64 position;
 uint64 size;
 uint8 flags;
-uint64 modTime;
 uint64 createTime;
+uint64 modTime;
 >
+
+// index (GFS4) - searched in place (mapped), records are decoded on access, varints are LEB128
+uint32 filesCount;
+uint32 slotsCount; // power of 2
+uint64 liveSize; // size of all files data
+uint64 recordsSize;
+uint64 dictionarySize;
+uint32 slots[slotsCount]; // hash index: record offset + 1 (0 - empty), first probe at hash64(id) & (slotsCount - 1), linear probing
+< for each file (ordered by position):
+varint idLength;
+char id[idLength];
+varint flags; // vfs_flags, vfs_record_flags tell which of optional fields follow
+varint position;
+varint size;
+varint createTime;
+varint modTime;
+uint32 crc; // crc32c of stored data (optional)
+uint64 content[2]; // hash128 of file data (optional), files with same content may share data
+>
+uint8 dictionary[dictionarySize]; // archive lz4 dictionary
+
+// journal (<archive>.journal, journaled mode) - index changes made after index on disk was written,
+// replayed on open and removed when index is written
+char id[4]; // "GFJ1"
+uint64 manifestOffset; // index the journal continues (journal of other index is stale)
+< for each record (one store/remove operation):
+uint32 size;
+uint32 crc; // crc32c of payload
+uint8 payload[size];
+>
+// payload is list of changes:
+// uint8 1 (put), uint32 idLength, char id[], uint64 position, size, createTime, modTime, uint32 crc, uint8 flags, uint64 content[2]
+// uint8 2 (remove), uint32 idLength, char id[]
+// dictionary change is not journaled (index is written)
 */
 
+// file entry flags
+enum vfs_flags {
+    vfs_compressed = 1,
+    vfs_directory = 2,
+    vfs_frame = 4, // compressed as lz4 frame
+    vfs_checksum = 8, // crc is valid
+    vfs_independent = 16, // frame blocks are compressed independently (no dictionary)
+    vfs_block_table = 32, // frame is followed by block offsets table (random access)
+    vfs_hc = 64, // compressed with lz4 hc level (informational, decompressed as any lz4 data)
+    vfs_dictionary = 128 // compressed with archive dictionary
+};
+
 // file entry
 struct vfs_file {
     string id;
     uint64 position;
     uint64 size;
-    uint8 flags; // 1 - compressed, 2 - directory
+    uint8 flags; // vfs_flags
     uint64 createTime;
     uint64 modTime;
+    uint32 crc; // crc32c of stored data
+    digest128 content; // hash128 of file data, empty if not hashed
+    uint64 hash; // hash64 of id (not stored)
+};
+
+// optional fields of GFS4 index record (stored with vfs_flags)
+enum vfs_record_flags {
+    vfs_record_crc = 256,
+    vfs_record_content = 512
 };
 
+// GFS4 index header
+struct vfs_table_header {
+    uint32 filesCount;
+    uint32 slotsCount;
+    uint64 liveSize;
+    uint64 recordsSize;
+    uint64 dictionarySize;
+};
+
+// digest as hash map key
+struct digest128_hash {
+    size_t operator()(const digest128 &d) const { return (size_t)d.low; }
+};
+
+// hash index slot
+struct vfs_slot {
+    uint32 file; // index in files + 1, 0 - empty slot
+    uint32 hash; // upper bits of id hash (skips most of string compares)
+};
+
+// sorted snapshot of archive ids for listings (directory is range of ids, subdirectories are skipped by search)
+struct vfs_listing {
+    struct entry {
+        string id;
+        size_t name; // file name offset in id
+        uint64 createTime, modTime;
+    };
+    std::vector<entry> files; // ordered by id
+    std::vector<uint32> byName; // files ordered by name
+};
+
+std::atomic<uint64> _vfsSerial = {0};
+
 // index for (real) file
 struct vfs {
+    uint64 serial = ++_vfsSerial; // identifies opened archive in cache (reopened archive gets new one)
     std::vector<vfs_file> files;
-    uint64 indexOffset;
+    std::vector<vfs_slot> slots; // open addressing (linear probing) hash index of files, power of 2 size
+    uint64 indexOffset; // end of data (files are appended here)
+    uint64 manifestOffset, manifestSize; // index stored on disk (header points to it)
+    uint64 liveSize = 0; // size of all files data
+    uint64 generation = 0; // changed on every file add/remove
     std::FILE *f;
     bool dirty;
-    std::vector<std::tuple<uint64, uint64>> removeQueue; // <position, size>
+    std::vector<std::tuple<uint64, uint64>> removeQueue; // <position, size> holes still referenced by index on disk
+    std::unordered_map<digest128, string, digest128_hash> contents; // content hash -> id of file holding data
+    std::unordered_map<uint64, std::vector<string>> shared; // data position -> ids of files sharing it (2 or more)
+    std::shared_mutex lock; // readers share, add/remove exclusive
+    std::mutex appendLock; // one writer appends at the end (taken before lock, data is written without lock)
+    std::shared_ptr<const_stream> map; // whole archive mapping (mapped mode), views returned by load keep it alive
+    std::mutex mapLock; // guards map refresh (readers hold shared lock only)
+    stream dictionary; // shared lz4 dictionary (stored in index)
+
+    // lazy index (GFS4 archive not modified since open) - files are searched in index on disk,
+    // files and slots are built on first modification
+    stream table; // read only view of index (mapped) or its copy, empty if files are built
+    std::mutex tableLock; // guards tableFiles (readers hold shared lock only)
+    std::unordered_map<uint32, vfs_file> tableFiles; // accessed entries by record offset (references stay valid)
+
+    // listing index (built on first listing, rebuilt on first listing after modification)
+    std::shared_ptr<const vfs_listing> listing;
+    uint64 listingGeneration = 0;
+    std::mutex listingLock; // guards listing (readers hold shared lock only)
+
+    // compaction pass state (guarded by _compactLock)
+    bool compacting = false;
+    uint64 compactCursor = 0; // end of compacted data
+    size_t compactNext = 0; // next file in compactOrder
+    uint64 compactGeneration = ~uint64(0);
+    std::vector<size_t> compactOrder; // files by position
+    std::unordered_set<string> compactRelocated; // files moved to the end in this pass
+    bool compactMoving = false; // file data is being copied (in chunks, locks are released between them)
+    bool compactRelocate = false; // moved file goes to the end
+    vfs_file compactFile; // moved file as it was when copy started
+    uint64 compactDest = 0, compactCopied = 0;
+    std::chrono::steady_clock::time_point compactRetry; // background compaction after io error waits until then
+
+    // write-ahead journal (journaled mode)
+    string journalPath;
+    bool journaling = false; // index changes are recorded
+    std::FILE *journal = nullptr; // opened on first record
+    stream journalOps; // changes of current operation (written as one record)
+    std::chrono::steady_clock::time_point journalSynced;
+    std::atomic<bool> journalUnsynced = {false}; // records written after last sync (synced by _journalSyncer)
 };
 
-// index map (full path as key)
+const uint64 _vfsHeaderSize = 4 + sizeof(uint64);
+
+// index map (full path as key), vfs entries are constructed in place (not movable)
 std::map<string, vfs> _vfs;
+std::shared_mutex _vfsLock; // guards _vfs map, exclusive for opening/closing archives
+
+// per thread decompression buffers (reused between reads)
+thread_local stream _readBuffer;
+thread_local lz4_reader _frameReader(nullptr);
+
+// decompressed archive files cache, size bounded LRU split to shards (less lock contention),
+// concurrent loads of the same file wait for one decompression
+struct file_cache {
+    typedef std::shared_future<std::shared_ptr<stream>> result;
+
+    struct entry {
+        uint64 modTime;
+        result data;
+        size_t size; // 0 until decompressed
+        const void *loader; // identifies loading call, null when loaded
+        std::list<string>::iterator lru;
+    };
+
+    struct shard {
+        std::mutex mtx;
+        std::unordered_map<string, entry> entries;
+        std::list<string> lru; // most recently used first
+        size_t size = 0;
+    };
+
+    static const size_t shardsCount = 16;
+    shard shards[shardsCount];
+    std::atomic<size_t> capacity = {64 * 1024 * 1024};
+    std::atomic<uint64> hits = {0}, misses = {0};
+
+    static string key(const vfs &v, const string &id) {
+        return strs(v.serial, ':', id);
+    }
+
+    shard &shardOf(const string &k) {
+        return shards[hash64(k) % shardsCount];
+    }
+
+    // drop least recently used decompressed entries (shard must be locked)
+    void evict(shard &sh) {
+        size_t limit = capacity / shardsCount;
+        for (auto i = sh.lru.end(); sh.size > limit && i != sh.lru.begin();) {
+            auto e = sh.entries.find(*--i);
+            if (e->second.loader != nullptr)
+                continue; // still loading
+            sh.size -= e->second.size;
+            i = sh.lru.erase(i);
+            sh.entries.erase(e);
+        }
+    }
+
+    // returns cached file or decompresses it with read (once for all concurrent callers)
+    std::shared_ptr<stream> get(const vfs &v, const vfs_file &f, std::function<void(stream &)> read) {
+        string k = key(v, f.id);
+        shard &sh = shardOf(k);
+        std::unique_lock<std::mutex> lock(sh.mtx);
+        auto e = sh.entries.find(k);
+        if (e != sh.entries.end() && e->second.modTime == f.modTime) {
+            ++hits;
+            sh.lru.splice(sh.lru.begin(), sh.lru, e->second.lru);
+            result r = e->second.data;
+            lock.unlock();
+            return r.get();
+        }
+        ++misses;
+        if (e != sh.entries.end()) {
+            sh.size -= e->second.size;
+            sh.lru.erase(e->second.lru);
+            sh.entries.erase(e);
+        }
+
+        std::promise<std::shared_ptr<stream>> p;
+        sh.lru.push_front(k);
+        sh.entries[k] = {f.modTime, p.get_future().share(), 0, &p, sh.lru.begin()};
+        lock.unlock();
+
+        auto s = std::make_shared<stream>();
+        read(*s);
+        p.set_value(s);
+
+        // keep only successfully loaded files that fit, entry may have been invalidated meanwhile
+        lock.lock();
+        e = sh.entries.find(k);
+        if (e != sh.entries.end() && e->second.loader == &p) {
+            if (s->size() == 0 || s->size() > capacity / shardsCount) {
+                sh.lru.erase(e->second.lru);
+                sh.entries.erase(e);
+            }
+            else {
+                e->second.loader = nullptr;
+                e->second.size = s->size();
+                sh.size += s->size();
+                evict(sh);
+            }
+        }
+        return s;
+    }
+
+    void invalidate(const vfs &v, const string &id) {
+        string k = key(v, id);
+        shard &sh = shardOf(k);
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        auto e = sh.entries.find(k);
+        if (e != sh.entries.end()) {
+            sh.size -= e->second.size;
+            sh.lru.erase(e->second.lru);
+            sh.entries.erase(e);
+        }
+    }
+
+    // drop all files (or files of given archive)
+    void clear(const vfs *v = nullptr) {
+        string prefix = v ? strs(v->serial, ':') : "";
+        for (auto &sh : shards) {
+            std::lock_guard<std::mutex> lock(sh.mtx);
+            for (auto i = sh.entries.begin(); i != sh.entries.end();) {
+                if (i->second.loader != nullptr || i->first.compare(0, prefix.size(), prefix) != 0) {
+                    ++i; // loading ones are dropped by loader
+                    continue;
+                }
+                sh.size -= i->second.size;
+                sh.lru.erase(i->second.lru);
+                i = sh.entries.erase(i);
+            }
+        }
+    }
+} _cache;
+
+// mapping covering archive range, mapping is refreshed if archive grew since, empty if could not map
+std::shared_ptr<const_stream> _vfs_mapping(vfs &v, uint64 end) {
+    std::lock_guard<std::mutex> lock(v.mapLock);
+    if (!v.map || v.map->size() < end)
+        v.map = _mapShared(v.f);
+    if (v.map && v.map->size() >= end)
+        return v.map;
+    return nullptr;
+}
+
+// checks if there are streams pointing to archive mapping (file data must not be moved)
+bool _vfs_mapping_used(vfs &v) {
+    return v.map && v.map.use_count() > 1;
+}
+
+// threads used for parallel work (loading, compression)
+size_t _workersCount() {
+    return std::max(2u, std::thread::hardware_concurrency());
+}
+
+thread_local bool _onLoaderThread = false; // close() joins loader threads, it must not run on them
+
+// loader threads for async loads (started on first use)
+struct loader_pool {
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool running = false;
+
+    ~loader_pool() {
+        shutdown();
+    }
+
+    void schedule(std::function<void()> task) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!running) {
+            running = true;
+            for (size_t i = 0; i < _workersCount(); ++i)
+                threads.emplace_back(&loader_pool::worker, this);
+        }
+        tasks.push_back(std::move(task));
+        cv.notify_one();
+    }
+
+    // finishes queued tasks and joins threads
+    void shutdown() {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            running = false;
+            cv.notify_all();
+        }
+        for (auto &t : threads)
+            t.join();
+        threads.clear();
+    }
+
+    void worker() {
+        _onLoaderThread = true;
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                while (running && tasks.empty())
+                    cv.wait(lock);
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+} _loader;
+
+// ordered parallel pipeline state, shared with loader threads (outlives caller)
+struct pipeline_state {
+    size_t count, window;
+    size_t next = 0, consumed = 0;
+    std::vector<char> ready;
+    std::function<void(size_t)> produce;
+    std::mutex mtx;
+    std::condition_variable cv;
+
+    // produces next item if window allows (lock is held before and after call)
+    bool step(std::unique_lock<std::mutex> &lock) {
+        if (next >= count || next >= consumed + window)
+            return false;
+        size_t i = next++;
+        lock.unlock();
+        produce(i);
+        lock.lock();
+        ready[i] = 1;
+        cv.notify_all();
+        return true;
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (next < count) {
+            if (!step(lock))
+                cv.wait(lock);
+        }
+    }
+};
+
+// runs produce(i) on loader threads and caller, consume(i) on caller in index order,
+// producers are at most window items ahead of consumer (bounded memory)
+void _pipeline(size_t count, size_t window, std::function<void(size_t)> produce, std::function<void(size_t)> consume) {
+    if (count == 0)
+        return;
+    auto p = std::make_shared<pipeline_state>();
+    p->count = count;
+    p->window = std::max<size_t>(window, 1);
+    p->ready.resize(count, 0);
+    p->produce = std::move(produce);
+    for (size_t i = 1; i < std::min(count, _workersCount()); ++i)
+        _loader.schedule([p]() { p->work(); });
+
+    std::unique_lock<std::mutex> lock(p->mtx);
+    for (size_t i = 0; i < count; ++i) {
+        while (!p->ready[i]) {
+            if (!p->step(lock))
+                p->cv.wait(lock);
+        }
+        lock.unlock();
+        consume(i);
+        lock.lock();
+        ++p->consumed;
+        p->cv.notify_all();
+    }
+}
+
+// same as above but recursively down in fs, directories of each level are read in parallel,
+// result is in breadth first order (deterministic), predicate calls are serialized
+fileList _filterFileListR(const string &basePath,
+                          const string &path,
+                          std::function<bool(fileInfo &)> pred = std::function<bool(fileInfo &)>(),
+                          bool times = true) {
+    fileList r;
+    std::vector<string> level = { path };
+    std::mutex predLock; // predicate does not have to be thread safe
+
+    while (!level.empty()) {
+        std::vector<fileList> found(level.size());
+        std::vector<std::vector<string>> subdirs(level.size());
+        std::vector<string> next;
+        _pipeline(level.size(), level.size(), [&](size_t i) {
+            // one read gives both subdirectories and matching files
+            found[i] = _filterFileList(basePath, level[i], [&](fileInfo &fi) {
+                if (fi.dir)
+                    subdirs[i].push_back(level[i] == "" ? fi.name : (level[i] + GE_DIR_SEPARATOR + fi.name));
+                if (!pred)
+                    return true;
+                std::lock_guard<std::mutex> lock(predLock);
+                return pred(fi);
+            }, times);
+            std::sort(subdirs[i].begin(), subdirs[i].end());
+        }, [&](size_t i) {
+            append(r, found[i]);
+            append(next, subdirs[i]);
+        });
+        level = std::move(next);
+    }
+    return r;
+}
 
 // get path from archive id
 string _vfs_extract_path(const string &id) {
@@ -253,38 +857,974 @@ string _vfs_extract_path(const string &id) {
     return "";
 }
 
-// get name from archive id
-string _vfs_extract_name(const string &id) {
-    size_t pos = id.find_last_of('/');
-    if (pos != id.npos)
-        return id.substr(pos + 1);
-    return id;
+// writes index to file (write pointer must be set before call)
+bool _vfs_write_index(vfs &v) {
+    // files in data order (compaction and batch loads walk archive in this order)
+    std::vector<const vfs_file*> order(v.files.size());
+    std::transform(v.files.begin(), v.files.end(), order.begin(), [](const auto &f) { return &f; });
+    std::sort(order.begin(), order.end(), [](const auto *a, const auto *b) { return a->position < b->position; });
+
+    // records and hash index of them (same as in memory one)
+    vfs_table_header h = {(uint32)order.size(), 16, v.liveSize, 0, v.dictionary.size()};
+    while (h.slotsCount < order.size() * 2)
+        h.slotsCount *= 2;
+    std::vector<uint32> slots(h.slotsCount, 0);
+    chunked_stream records;
+    for (const auto *f : order) {
+        gassertl(records.size() < 0xffffffff, "vfs index: too many files");
+        size_t j = f->hash & (h.slotsCount - 1);
+        while (slots[j] != 0)
+            j = (j + 1) & (h.slotsCount - 1);
+        slots[j] = uint32(records.size() + 1);
+
+        records.writeVarint(f->id.size());
+        records.write(f->id.data(), f->id.size());
+        records.writeVarint(f->flags | (f->crc != 0 ? vfs_record_crc : 0) | (f->content.empty() ? 0 : vfs_record_content));
+        records.writeVarint(f->position);
+        records.writeVarint(f->size);
+        records.writeVarint(f->createTime);
+        records.writeVarint(f->modTime);
+        if (f->crc != 0)
+            records.write(f->crc);
+        if (!f->content.empty())
+            records.write(f->content);
+    }
+    h.recordsSize = records.size();
+
+    chunked_stream s;
+    s.write(h);
+    s.write(slots.data(), slots.size() * sizeof(uint32));
+    s.write(records);
+    if (v.dictionary.size() > 0) {
+        const stream &d = v.dictionary;
+        s.write(d.data(), d.size());
+    }
+
+    bool written = _fwrite(v.f, s);
+    const char *e = strerror(errno);
+    gassertl(written, strs("could not write file index, errno: ", e));
+    return written;
 }
 
-// writes index to file (write pointer must be set before call)
-void _vfs_write_index(vfs &v) {
-    uint32 filesCount = (uint32)v.files.size();
+// reads GFS2 index
+bool _vfs_read_index_v2(stream &s, vfs &v) {
+    uint32 filesCount = 0;
+    s.read(filesCount);
+    while (filesCount-- > 0) {
+        vfs_file fi;
+        s.read(fi.id);
+        s.read(fi.position);
+        s.read(fi.size);
+        s.read(fi.flags);
+        s.read(fi.createTime);
+        s.read(fi.modTime);
+        fi.crc = 0;
+        v.files.push_back(fi);
+    }
+    return true;
+}
 
-    // write index to stream and write
-    stream s;
-    s.reserve(filesCount * (4 + 10 + 8 + 8 + 1 + 8 + 8)); // estimate size
+// GFS4 index parts (fields are copied out - mapped index may be unaligned)
+struct vfs_table {
+    vfs_table_header h;
+    const uint8 *slots, *records;
+
+    vfs_table(const stream &t) {
+        memcpy(&h, t.data(), sizeof(h));
+        slots = t.data() + sizeof(h);
+        records = slots + (size_t)h.slotsCount * sizeof(uint32);
+    }
+
+    uint32 slot(size_t i) const {
+        uint32 record;
+        memcpy(&record, slots + i * sizeof(uint32), sizeof(record));
+        return record;
+    }
+
+    // id of record at offset, false if corrupted
+    bool id(uint64 offset, const char *&id, uint64 &length) const {
+        if (offset >= h.recordsSize)
+            return false;
+        size_t n = varintDecode(records + offset, h.recordsSize - offset, length);
+        if (n == 0 || length > h.recordsSize - offset - n)
+            return false;
+        id = (const char*)records + offset + n;
+        return true;
+    }
+};
+
+// use GFS4 index in place (nothing is decoded, index stays mapped / read), false if corrupted
+bool _vfs_open_table(vfs &v, stream &&index) {
+    const stream &t = index;
+    if (t.size() < sizeof(vfs_table_header))
+        return false;
+    vfs_table tb(t);
+    const vfs_table_header &h = tb.h;
+    uint64 size = sizeof(h) + (uint64)h.slotsCount * sizeof(uint32);
+    if (h.slotsCount < 16 || (h.slotsCount & (h.slotsCount - 1)) != 0 || h.slotsCount < (uint64)h.filesCount * 2 ||
+        h.recordsSize > t.size() || h.dictionarySize > t.size() || size + h.recordsSize + h.dictionarySize > t.size())
+        return false;
+
+    v.liveSize = h.liveSize;
+    v.manifestSize = size + h.recordsSize + h.dictionarySize;
+    if (h.dictionarySize > 0) {
+        v.dictionary.resize(h.dictionarySize);
+        memcpy(v.dictionary.data(), tb.records + h.recordsSize, h.dictionarySize);
+    }
+    v.table = std::move(index);
+    return true;
+}
+
+// decode GFS4 index record at offset (moved to next record), false if corrupted
+bool _vfs_table_entry(const vfs &v, uint64 &offset, vfs_file &f) {
+    vfs_table tb(v.table);
+    const char *id;
+    uint64 length;
+    if (!tb.id(offset, id, length))
+        return false;
+    f.id.assign(id, length);
+    f.hash = hash64(f.id);
+
+    const uint8 *r = (const uint8*)id + length, *end = tb.records + tb.h.recordsSize;
+    uint64 fields[5]; // flags, position, size, createTime, modTime
+    for (auto &field : fields) {
+        size_t n = varintDecode(r, end - r, field);
+        if (n == 0)
+            return false;
+        r += n;
+    }
+    f.flags = (uint8)fields[0];
+    f.position = fields[1];
+    f.size = fields[2];
+    f.createTime = fields[3];
+    f.modTime = fields[4];
+    f.crc = 0;
+    f.content = {0, 0};
+    size_t optional = (fields[0] & vfs_record_crc ? sizeof(f.crc) : 0) + (fields[0] & vfs_record_content ? sizeof(f.content) : 0);
+    if (optional > (size_t)(end - r))
+        return false;
+    if (fields[0] & vfs_record_crc) {
+        memcpy(&f.crc, r, sizeof(f.crc));
+        r += sizeof(f.crc);
+    }
+    if (fields[0] & vfs_record_content) {
+        memcpy(&f.content, r, sizeof(f.content));
+        r += sizeof(f.content);
+    }
+    offset = r - tb.records;
+    return true;
+}
+
+// search GFS4 index in place, returns record offset + 1 (0 - not found)
+uint32 _vfs_table_find(const vfs &v, const string &id) {
+    vfs_table tb(v.table);
+    size_t mask = tb.h.slotsCount - 1;
+    for (size_t i = hash64(id) & mask, probes = 0; probes < tb.h.slotsCount; i = (i + 1) & mask, ++probes) {
+        uint32 record = tb.slot(i);
+        const char *rid;
+        uint64 length;
+        if (record == 0 || !tb.id(record - 1, rid, length))
+            return 0;
+        if (length == id.size() && 0 == memcmp(rid, id.data(), id.size()))
+            return record;
+    }
+    return 0;
+}
+
+// insert file to hash index (there must be free slot)
+void _vfs_index_insert(vfs &v, size_t file) {
+    size_t mask = v.slots.size() - 1;
+    uint64 h = v.files[file].hash;
+    size_t i = h & mask;
+    while (v.slots[i].file != 0)
+        i = (i + 1) & mask;
+    v.slots[i] = {uint32(file + 1), uint32(h >> 32)};
+}
+
+// find hash index slot of file
+size_t _vfs_index_slot(vfs &v, size_t file) {
+    size_t mask = v.slots.size() - 1;
+    size_t i = v.files[file].hash & mask;
+    while (v.slots[i].file != file + 1)
+        i = (i + 1) & mask;
+    return i;
+}
+
+// rebuild hash index (load factor is kept below 0.5)
+void _vfs_index_rebuild(vfs &v) {
+    size_t size = 16;
+    while (size < v.files.size() * 2)
+        size *= 2;
+    v.slots.assign(size, {0, 0});
+    for (size_t i = 0; i < v.files.size(); ++i)
+        _vfs_index_insert(v, i);
+}
+
+// search for file id in index, null if not found (lazy index: found entry is decoded,
+// may be called with shared lock, returned entry stays valid until index is modified)
+vfs_file *_vfs_find_file(vfs &v, const string &id) {
+    const stream &t = v.table;
+    if (t.size() > 0) {
+        uint32 file = _vfs_table_find(v, id);
+        if (file == 0)
+            return nullptr;
+        std::lock_guard<std::mutex> lock(v.tableLock);
+        auto f = v.tableFiles.find(file - 1);
+        if (f == v.tableFiles.end()) {
+            vfs_file fi;
+            uint64 offset = file - 1;
+            if (!_vfs_table_entry(v, offset, fi))
+                return nullptr;
+            f = v.tableFiles.emplace(file - 1, std::move(fi)).first;
+        }
+        return &f->second;
+    }
+
+    if (v.slots.empty())
+        return nullptr;
+    size_t mask = v.slots.size() - 1;
+    uint64 h = hash64(id);
+    for (size_t i = h & mask; v.slots[i].file != 0; i = (i + 1) & mask) {
+        const vfs_slot &sl = v.slots[i];
+        if (sl.hash == uint32(h >> 32) && v.files[sl.file - 1].id == id)
+            return &v.files[sl.file - 1];
+    }
+    return nullptr;
+}
+
+// track data shared by files with same content (file must be in hash index), false if file data is shared
+bool _vfs_share(vfs &v, const vfs_file &f) {
+    if (f.content.empty())
+        return true;
+    auto c = v.contents.emplace(f.content, f.id);
+    if (c.second)
+        return true;
+    const vfs_file *holder = _vfs_find_file(v, c.first->second);
+    if (holder == nullptr || holder->position != f.position)
+        return true; // same content stored twice (added while deduplication was disabled)
+    auto &ids = v.shared[f.position];
+    if (ids.empty())
+        ids.push_back(holder->id);
+    ids.push_back(f.id);
+    return false;
+}
+
+// compute id hashes and build hash index after index read
+void _vfs_index_build(vfs &v) {
+    v.liveSize = 0;
+    v.contents.clear();
+    v.shared.clear();
+    for (auto &f : v.files)
+        f.hash = hash64(f.id);
+    _vfs_index_rebuild(v);
     for (const auto &f : v.files) {
-        s.write(f.id);
-        s.write(f.position);
-        s.write(f.size);
-        s.write(f.flags);
-        s.write(f.createTime);
-        s.write(f.modTime);
-    }
-    size_t writeCount = std::fwrite(&filesCount, sizeof(uint32), 1, v.f);
-    writeCount += std::fwrite(s.data(), s.size(), 1, v.f);
+        if (_vfs_share(v, f))
+            v.liveSize += f.size; // shared data counts once
+    }
+}
+
+// decode whole lazy index to files and hash index (before modification, vfs locked for write)
+void _vfs_materialize(vfs &v) {
+    const stream &t = v.table;
+    if (t.size() == 0)
+        return;
+    uint32 count = vfs_table(t).h.filesCount;
+    v.files.resize(count);
+    uint64 offset = 0;
+    size_t valid = 0;
+    while (valid < count && _vfs_table_entry(v, offset, v.files[valid]))
+        ++valid;
+    if (valid < count)
+        logError(strs("vfs index: corrupted index, ", count - valid, " files skipped"));
+    v.files.resize(valid);
+    _vfs_index_build(v);
+    v.table = stream();
+    v.tableFiles.clear();
+}
+
+// call op for every file in index (lazy index entries are decoded one by one)
+template <typename T_OP>
+void _vfs_for_each(vfs &v, T_OP op) {
+    const stream &t = v.table;
+    if (t.size() == 0) {
+        for (const auto &f : v.files)
+            op(f);
+        return;
+    }
+    vfs_file f;
+    uint32 count = vfs_table(t).h.filesCount;
+    uint64 offset = 0;
+    for (uint32 i = 0; i < count && _vfs_table_entry(v, offset, f); ++i)
+        op(f);
+}
+
+// listing index of archive (vfs locked at least for read)
+std::shared_ptr<const vfs_listing> _vfs_listing(vfs &v) {
+    std::lock_guard<std::mutex> lock(v.listingLock);
+    if (v.listing && v.listingGeneration == v.generation)
+        return v.listing;
+
+    auto l = std::make_shared<vfs_listing>();
+    _vfs_for_each(v, [&l](const vfs_file &f) {
+        size_t slash = f.id.find_last_of('/');
+        l->files.push_back({f.id, slash == string::npos ? 0 : slash + 1, f.createTime, f.modTime});
+    });
+    std::sort(l->files.begin(), l->files.end(), [](const auto &a, const auto &b) { return a.id < b.id; });
+    l->byName.resize(l->files.size());
+    std::iota(l->byName.begin(), l->byName.end(), 0);
+    std::sort(l->byName.begin(), l->byName.end(), [&l](uint32 a, uint32 b) {
+        const auto &fa = l->files[a], &fb = l->files[b];
+        int c = fa.id.compare(fa.name, string::npos, fb.id, fb.name, string::npos);
+        return c < 0 || (c == 0 && a < b);
+    });
+    v.listing = l;
+    v.listingGeneration = v.generation;
+    return v.listing;
+}
+
+// range of listing files in directory and its subdirectories (id prefix "dir/", all files for root)
+std::pair<size_t, size_t> _vfs_listing_subtree(const vfs_listing &l, const string &dir) {
+    if (dir.empty())
+        return std::make_pair(0, l.files.size());
+    auto less = [](const vfs_listing::entry &e, const string &id) { return e.id < id; };
+    string prefix = dir + '/';
+    size_t first = std::lower_bound(l.files.begin(), l.files.end(), prefix, less) - l.files.begin();
+    prefix.back() = '/' + 1; // first id after all starting with "dir/"
+    size_t last = std::lower_bound(l.files.begin() + first, l.files.end(), prefix, less) - l.files.begin();
+    return std::make_pair(first, last);
+}
+
+//- vfs journal
+enum vfs_journal_op {
+    vfs_journal_put = 1,
+    vfs_journal_remove = 2
+};
+
+const std::chrono::milliseconds _journalSyncInterval(50); // records are synced to device in batches
+
+// sync archive, then journal (vfs locked, at least shared)
+bool _vfs_journal_sync(vfs &v) {
+    v.journalUnsynced = false;
+    v.journalSynced = std::chrono::steady_clock::now();
+    return _sync(v.f) && _sync(v.journal);
+}
+
+// background thread syncing journals left unsynced by batching, record is on device at most
+// sync interval after it was written
+struct journal_syncer {
+    std::thread thread;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool running = false, wake = false, stop = false;
+
+    ~journal_syncer() {
+        shutdown();
+    }
+
+    void notify() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!running) {
+            running = true;
+            stop = false;
+            thread = std::thread([this]() { worker(); });
+        }
+        wake = true;
+        cv.notify_one();
+    }
+
+    void shutdown() {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!running)
+            return;
+        stop = true;
+        cv.notify_one();
+        lock.unlock();
+        thread.join();
+        lock.lock();
+        running = false;
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!stop) {
+            cv.wait(lock, [this]() { return wake || stop; });
+            wake = false;
+            cv.wait_for(lock, _journalSyncInterval, [this]() { return stop; });
+            lock.unlock();
+
+            // writers are excluded (journal and archive handles are not changed), readers are not blocked
+            std::shared_lock<std::shared_mutex> vlock(_vfsLock);
+            for (auto &e : _vfs) {
+                vfs &v = e.second;
+                std::shared_lock<std::shared_mutex> alock(v.lock);
+                if (v.journalUnsynced && v.journal != nullptr && !_vfs_journal_sync(v)) {
+                    const char *err = strerror(errno);
+                    gassertl(false, strs("vfs journal: could not sync: ", v.journalPath, ", errno: ", err));
+                }
+            }
+            vlock.unlock();
+            lock.lock();
+        }
+    }
+} _journalSyncer;
+
+// record file added to index
+void _vfs_journal_put(vfs &v, const vfs_file &f) {
+    stream &o = v.journalOps;
+    o.write((uint8)vfs_journal_put);
+    o.write(f.id);
+    o.write(f.position);
+    o.write(f.size);
+    o.write(f.createTime);
+    o.write(f.modTime);
+    o.write(f.crc);
+    o.write(f.flags);
+    o.write(f.content);
+}
+
+// record file removed from index
+void _vfs_journal_remove(vfs &v, const string &id) {
+    v.journalOps.write((uint8)vfs_journal_remove);
+    v.journalOps.write(id);
+}
+
+// write recorded changes as one record (file data must be written before), archive and journal
+// are synced to device if last sync is older than sync interval (otherwise by _journalSyncer
+// within the interval), false if failed
+bool _vfs_journal_commit(vfs &v) {
+    if (!v.journaling || v.journalOps.size() == 0)
+        return true;
+
+    bool written = true;
+    if (v.journal == nullptr) {
+        // existing journal continues current index (kept if index could not be written)
+        v.journal = std::fopen(v.journalPath.c_str(), "ab");
+        written = v.journal != NULL && 0 == std::fseek(v.journal, 0, SEEK_END);
+        if (written && std::ftell(v.journal) == 0)
+            written = 1 == std::fwrite("GFJ1", 4, 1, v.journal) && 1 == std::fwrite(&v.manifestOffset, sizeof(uint64), 1, v.journal);
+    }
+    const stream &ops = v.journalOps;
+    uint32 header[2] = {(uint32)ops.size(), crc32c(ops.data(), ops.size())};
+    written = written && 1 == std::fwrite(header, sizeof(header), 1, v.journal) &&
+              1 == std::fwrite(ops.data(), ops.size(), 1, v.journal) && 0 == std::fflush(v.journal);
+    v.journalOps.clear();
+
+    // record reaches journal file before archive data is synced - after power loss journal may hold
+    // records of lost data, replay drops them by checksum of stored data (_vfs_verify)
+    if (written) {
+        if (std::chrono::steady_clock::now() - v.journalSynced >= _journalSyncInterval)
+            written = _vfs_journal_sync(v);
+        else if (!v.journalUnsynced.exchange(true))
+            _journalSyncer.notify();
+    }
+    if (!written) {
+        const char *e = strerror(errno);
+        gassertl(false, strs("vfs journal: could not write: ", v.journalPath, ", errno: ", e));
+    }
+    return written;
+}
+
+// index is written, journal is not needed anymore (kept for replay if index could not be written)
+void _vfs_journal_reset(vfs &v, bool remove = true) {
+    if (v.journal != nullptr)
+        std::fclose(v.journal);
+    v.journal = nullptr;
+    v.journalUnsynced = false;
+    v.journalOps.clear();
+    if (remove && !v.journalPath.empty())
+        std::remove(v.journalPath.c_str());
+}
+
+// checks crc32c of stored file data (read in chunks), true if file has no checksum
+bool _vfs_verify(vfs &v, const vfs_file &f) {
+    if (!(f.flags & vfs_checksum))
+        return true;
+    stream &b = _readBuffer;
+    b.resize((size_t)std::min<uint64>(f.size, 1024 * 1024));
+    uint32 crc = 0;
+    for (uint64 offset = 0; offset < f.size; ) {
+        size_t n = (size_t)std::min<uint64>(b.size(), f.size - offset);
+        if (!_pread(v.f, b.data(), n, f.position + offset))
+            return false;
+        crc = crc32c(b.data(), n, crc);
+        offset += n;
+    }
+    return crc == f.crc;
+}
+
+void _vfs_insert_file(vfs &v, vfs_file &&f);
+void _vfs_remove(vfs &v, vfs_file *f);
+bool _vfs_persist(vfs &v);
+
+// apply journal records written after index on disk, returns count of records applied,
+// torn or invalid record ends replay (it and following records are dropped)
+size_t _vfs_journal_replay(vfs &v) {
+    std::FILE *j = std::fopen(v.journalPath.c_str(), "rb");
+    if (j == NULL)
+        return 0;
+
+    size_t applied = 0;
+    char id[4];
+    uint64 manifestOffset;
+    if (1 != std::fread(id, 4, 1, j) || memcmp(id, "GFJ1", 4) != 0 ||
+        1 != std::fread(&manifestOffset, sizeof(uint64), 1, j) || manifestOffset != v.manifestOffset) {
+        std::fclose(j);
+        logInfo(strs("vfs journal: stale journal ignored: ", v.journalPath));
+        return 0;
+    }
+
+    _vfs_materialize(v);
+    uint64 end = v.indexOffset; // archive size
+    uint64 left = std::fseek(j, 0, SEEK_END) == 0 ? std::ftell(j) : 0;
+    std::fseek(j, 4 + sizeof(uint64), SEEK_SET);
+    left -= std::min<uint64>(left, 4 + sizeof(uint64));
+    uint32 header[2];
+    stream payload;
+    while (left >= sizeof(header) && 1 == std::fread(header, sizeof(header), 1, j) && header[0] <= left - sizeof(header)) {
+        left -= sizeof(header) + header[0];
+        payload.resize(header[0]);
+        payload.setPosFromBegin(0);
+        if ((header[0] > 0 && 1 != std::fread(payload.data(), header[0], 1, j)) || crc32c(payload) != header[1])
+            break;
+
+        // decode whole record first, it is applied only if all its files are intact
+        const size_t putSize = 4 * sizeof(uint64) + sizeof(uint32) + sizeof(uint8) + sizeof(digest128);
+        std::vector<std::tuple<uint8, vfs_file>> changes;
+        bool valid = true;
+        while (valid && payload.getPos() < payload.size()) {
+            uint8 op = 0;
+            uint32 length = 0;
+            vfs_file f = {};
+            valid = payload.read(op) == sizeof(uint8) && (op == vfs_journal_put || op == vfs_journal_remove) &&
+                    payload.read(length) == sizeof(uint32) && length <= payload.size() - payload.getPos();
+            if (!valid)
+                break;
+            f.id.resize(length);
+            payload.read(&f.id[0], length);
+            if (op == vfs_journal_put) {
+                valid = payload.size() - payload.getPos() >= putSize;
+                if (valid) {
+                    payload.read(f.position);
+                    payload.read(f.size);
+                    payload.read(f.createTime);
+                    payload.read(f.modTime);
+                    payload.read(f.crc);
+                    payload.read(f.flags);
+                    payload.read(f.content);
+                    // data may be lost if journal was synced before archive
+                    valid = f.position + f.size <= end && _vfs_verify(v, f);
+                }
+            }
+            changes.push_back(std::make_tuple(op, std::move(f)));
+        }
+        if (!valid) {
+            logError(strs("vfs journal: record with lost data, replay stopped: ", v.journalPath));
+            break;
+        }
+
+        for (auto &c : changes) {
+            vfs_file &f = std::get<1>(c);
+            auto old = _vfs_find_file(v, f.id);
+            if (old != nullptr)
+                _vfs_remove(v, old);
+            if (std::get<0>(c) == vfs_journal_put)
+                _vfs_insert_file(v, std::move(f));
+        }
+        ++applied;
+    }
+    std::fclose(j);
+    if (applied > 0) {
+        v.dirty = true;
+        logInfo(strs("vfs journal: replayed ", applied, " records: ", v.journalPath));
+    }
+    return applied;
+}
+
+// add file to index
+void _vfs_insert_file(vfs &v, vfs_file &&f) {
+    if (v.journaling)
+        _vfs_journal_put(v, f);
+    f.hash = hash64(f.id);
+    ++v.generation;
+    v.files.push_back(std::move(f));
+    if (v.files.size() * 2 > v.slots.size())
+        _vfs_index_rebuild(v);
+    else _vfs_index_insert(v, v.files.size() - 1);
+    if (_vfs_share(v, v.files.back()))
+        v.liveSize += v.files.back().size;
+}
+
+// remove file from index (last file is moved in place of removed one), returns false if file data is still
+// used by other files
+bool _vfs_erase_file(vfs &v, vfs_file *f) {
+    if (v.journaling)
+        _vfs_journal_remove(v, f->id);
+    _cache.invalidate(v, f->id);
+    ++v.generation;
+    bool released = true;
+    auto c = v.contents.find(f->content);
+    auto s = v.shared.find(f->position);
+    if (s != v.shared.end()) {
+        auto &ids = s->second;
+        ids.erase(std::find(ids.begin(), ids.end(), f->id));
+        if (c != v.contents.end() && c->second == f->id)
+            c->second = ids.front();
+        if (ids.size() == 1)
+            v.shared.erase(s);
+        released = false;
+    }
+    else if (c != v.contents.end() && c->second == f->id)
+        v.contents.erase(c);
+    if (released)
+        v.liveSize -= f->size;
+
+    size_t file = f - v.files.data();
+    size_t last = v.files.size() - 1;
+    size_t mask = v.slots.size() - 1;
+
+    // backward shift deletion - no tombstones, probe sequences stay short
+    size_t i = _vfs_index_slot(v, file);
+    for (size_t j = (i + 1) & mask; v.slots[j].file != 0; j = (j + 1) & mask) {
+        size_t home = v.files[v.slots[j].file - 1].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            v.slots[i] = v.slots[j];
+            i = j;
+        }
+    }
+    v.slots[i] = {0, 0};
+
+    if (file != last) {
+        v.slots[_vfs_index_slot(v, last)].file = uint32(file + 1);
+        v.files[file] = std::move(v.files[last]);
+    }
+    v.files.pop_back();
+    return released;
+}
+
+// point archive header to index
+bool _vfs_write_header(vfs &v, uint64 indexOffset) {
+    std::fseek(v.f, 0, SEEK_SET);
+    bool written = 1 == std::fwrite("GFS4", 4, 1, v.f) && 1 == std::fwrite(&indexOffset, sizeof(uint64), 1, v.f);
+    written = 0 == std::fflush(v.f) && written;
     const char *e = strerror(errno);
-    gassertl(writeCount == 2, strs("could not write file index, errno: ", e));
+    gassertl(written, strs("could not write vfs header, errno: ", e));
+    return written;
+}
+
+// append index (manifest) and point header to it, holes are not referenced on disk anymore (may be reused)
+bool _vfs_persist(vfs &v) {
+    std::fseek(v.f, (long)v.indexOffset, SEEK_SET);
+    if (!_vfs_write_index(v))
+        return false;
+    uint64 size = std::ftell(v.f) - v.indexOffset;
+    if (0 != std::fflush(v.f) || (v.journaling && !_sync(v.f)) || !_vfs_write_header(v, v.indexOffset))
+        return false;
+    if (v.journaling && !_sync(v.f))
+        return false;
+    _vfs_journal_reset(v); // stale from now on (other manifest offset)
+    v.manifestOffset = v.indexOffset;
+    v.manifestSize = size;
+    v.indexOffset += size;
+    v.removeQueue.clear();
+    v.dirty = false;
+    return true;
+}
+
+// checks if range may be referenced by index on disk
+bool _vfs_pending(vfs &v, uint64 begin, uint64 end) {
+    if (begin < v.manifestOffset + v.manifestSize && v.manifestOffset < end)
+        return true;
+    for (const auto &h : v.removeQueue) {
+        if (begin < std::get<0>(h) + std::get<1>(h) && std::get<0>(h) < end)
+            return true;
+    }
+    return false;
+}
+
+// size of holes (removed/moved files, old indices)
+uint64 _vfs_dead_size(vfs &v) {
+    return v.indexOffset - _vfsHeaderSize - v.liveSize - v.manifestSize;
+}
+
+std::mutex _compactLock; // one compaction step at a time (guards vfs compaction state)
+std::atomic<bool> _compactStop = {false};
+const uint64 _compactMinimum = 4 * 1024 * 1024; // archives are compacted when holes take 25% and at least this
+const uint64 _compactChunk = 4 * 1024 * 1024; // data copied in one step (one batch of _vfs_copy buffers)
+const auto _compactRetryDelay = std::chrono::seconds(30); // io error aborts pass, background compaction waits this long
+
+// copy file data to unused range (source is not modified, readers may read it meanwhile), false if aborted
+bool _vfs_copy(vfs &v, uint64 from, uint64 to, uint64 size) {
+    thread_local io_engine io(8, 1024 * 1024, 4);
+    io_engine::request requests[4];
+    int fd = _fd(v.f);
+    while (size > 0) {
+        if (_compactStop)
+            return false;
+
+        // batch of chunks is read to registered buffers, then written in one batch
+        size_t n = 0;
+        for (uint64 o = 0; n < io.buffersCount() && o < size; ++n) {
+            size_t chunk = (size_t)std::min<uint64>(io.bufferSize(), size - o);
+            requests[n] = {fd, io.buffer(n), chunk, from + o, false, (int)n, 0};
+            o += chunk;
+        }
+        io.submit(requests, n);
+        uint64 moved = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (requests[i].result != (int64)requests[i].size)
+                return false;
+            requests[i] = {fd, io.buffer(i), requests[i].size, to + moved, true, (int)i, 0};
+            moved += requests[i].size;
+        }
+        io.submit(requests, n);
+        for (size_t i = 0; i < n; ++i) {
+            if (requests[i].result != (int64)requests[i].size) {
+                logError("vfs compaction: could not move file data");
+                return false;
+            }
+        }
+        from += moved;
+        to += moved;
+        size -= moved;
+    }
+    return true;
+}
+
+// finish compaction: index is written right after data and file is truncated (vfs locked for write)
+void _vfs_compact_finish(vfs &v) {
+    uint64 end = v.compactCursor;
+    v.compacting = false;
+    v.compactRelocated.clear();
+    if (!v.dirty && v.manifestOffset == end && v.indexOffset == end + v.manifestSize)
+        return;
+
+    // new index at the end first, then nothing before it is referenced on disk and it may be moved
+    if (!_vfs_persist(v))
+        return;
+    if (end + v.manifestSize <= v.manifestOffset) {
+        std::fseek(v.f, (long)end, SEEK_SET);
+        if (!_vfs_write_index(v) || 0 != std::fflush(v.f) || (v.journaling && !_sync(v.f)) || !_vfs_write_header(v, end))
+            return;
+        if (v.journaling)
+            _sync(v.f);
+        v.manifestOffset = end;
+    }
+    v.map.reset();
+    v.indexOffset = v.manifestOffset + v.manifestSize;
+    _resize(v.f, v.indexOffset);
+}
+
+// one compaction step, copies next chunk of file moved to first hole (if it fits and hole is not referenced
+// on disk) or to the end of archive, index is switched after last chunk, readers are not blocked while data
+// is copied, returns bytes copied (global lock must be shared, _compactLock held - both may be released between
+// steps), done is set when archive is compacted (or compaction is deferred)
+uint64 _vfs_compact_step(vfs &v, bool &done) {
+    done = false;
+    if (!v.compactMoving) {
+        std::lock_guard<std::mutex> alock(v.appendLock); // end of data may be reserved, index may be written
+        std::unique_lock<std::shared_mutex> lock(v.lock);
+        if (!v.compacting) {
+            uint64 dead = _vfs_dead_size(v);
+            if (dead < _compactMinimum || dead * 4 < v.indexOffset || std::chrono::steady_clock::now() < v.compactRetry) {
+                done = true;
+                return 0;
+            }
+            v.compacting = true;
+            v.compactGeneration = ~uint64(0);
+        }
+        _vfs_materialize(v);
+
+        // loaded views point to mapped file data, compact later
+        if (_vfs_mapping_used(v)) {
+            logInfo("vfs compaction: archive mapping in use, compaction deferred");
+            v.compacting = false;
+            done = true;
+            return 0;
+        }
+
+        // files order changed by add/remove - start from archive beginning
+        if (v.compactGeneration != v.generation) {
+            v.compactOrder.resize(v.files.size());
+            for (size_t i = 0; i < v.files.size(); ++i)
+                v.compactOrder[i] = i;
+            std::sort(v.compactOrder.begin(), v.compactOrder.end(),
+                      [&v](size_t a, size_t b) { return v.files[a].position < v.files[b].position; });
+            v.compactOrder.erase(std::unique(v.compactOrder.begin(), v.compactOrder.end(),
+                                             [&v](size_t a, size_t b) { return v.files[a].position == v.files[b].position; }),
+                                 v.compactOrder.end()); // shared data is moved once
+            v.compactGeneration = v.generation;
+            v.compactCursor = _vfsHeaderSize;
+            v.compactNext = 0;
+        }
+
+        // skip files that are already in place
+        while (v.compactNext < v.compactOrder.size() && v.files[v.compactOrder[v.compactNext]].position == v.compactCursor)
+            v.compactCursor += v.files[v.compactOrder[v.compactNext++]].size;
+        if (v.compactNext == v.compactOrder.size()) {
+            _vfs_compact_finish(v);
+            done = true;
+            return 0;
+        }
+
+        // hole may be referenced on disk - move file to the end (it fits into hole in next pass over it)
+        const vfs_file &f = v.files[v.compactOrder[v.compactNext]];
+        uint64 gap = f.position - v.compactCursor;
+        bool fits = f.size <= gap && !_vfs_pending(v, v.compactCursor, v.compactCursor + f.size);
+        if (!fits && v.compactRelocated.count(f.id) > 0) {
+            if (!_vfs_persist(v)) {
+                done = true;
+                return 0;
+            }
+            fits = f.size <= gap;
+        }
+        v.compactRelocate = !fits;
+        if (v.compactRelocate) {
+            v.compactDest = v.indexOffset; // reserved, new files are appended after it
+            v.indexOffset += f.size;
+        }
+        else v.compactDest = v.compactCursor;
+        v.compactFile = f;
+        v.compactCopied = 0;
+        v.compactMoving = true;
+    }
 
-    // trim file here
-    _resize(v.f, std::ftell(v.f));
+    // copy next chunk of data (index still points to source, readers use it)
+    const vfs_file &e = v.compactFile;
+    uint64 dest = v.compactDest;
+    bool relocate = v.compactRelocate;
+    uint64 chunk = std::min(_compactChunk, e.size - v.compactCopied);
+    bool copied = _vfs_copy(v, e.position + v.compactCopied, dest + v.compactCopied, chunk);
+    if (copied) {
+        v.compactCopied += chunk;
+        if (v.compactCopied < e.size)
+            return chunk;
+    }
+    v.compactMoving = false;
+    bool failed = !copied && !_compactStop; // io error (no space, device error)
+
+    // switch index to new location if file did not change meanwhile
+    std::unique_lock<std::mutex> alock(v.appendLock, std::defer_lock);
+    if (relocate)
+        alock.lock(); // reserved range may be released
+    std::unique_lock<std::shared_mutex> lock(v.lock);
+    auto f = _vfs_find_file(v, e.id);
+    if (!copied || f == nullptr || f->position != e.position || f->size != e.size || f->crc != e.crc) {
+        if (relocate) {
+            if (v.indexOffset == dest + e.size)
+                v.indexOffset = dest; // nothing was appended after reserved range
+            else v.removeQueue.push_back(std::make_tuple(dest, e.size));
+        }
+        if (failed) {
+            // pass is aborted (retrying at once would fail again), next one starts after delay
+            logError(strs("vfs compaction: could not move file: ", e.id, ", compaction aborted"));
+            v.compacting = false;
+            v.compactRetry = std::chrono::steady_clock::now() + _compactRetryDelay;
+        }
+        done = _compactStop || failed;
+        return copied ? chunk : 0;
+    }
+    auto s = v.shared.find(e.position);
+    if (s != v.shared.end()) {
+        // all files sharing data
+        std::vector<string> ids = std::move(s->second);
+        v.shared.erase(s);
+        for (const auto &id : ids)
+            _vfs_find_file(v, id)->position = dest;
+        v.shared[dest] = std::move(ids);
+    }
+    else f->position = dest;
+    v.removeQueue.push_back(std::make_tuple(e.position, e.size));
+    v.dirty = true;
+    if (relocate) {
+        size_t file = v.compactOrder[v.compactNext];
+        v.compactOrder.erase(v.compactOrder.begin() + v.compactNext);
+        v.compactOrder.push_back(file);
+        v.compactRelocated.insert(e.id);
+    }
+    else {
+        v.compactCursor += e.size;
+        ++v.compactNext;
+    }
+    return chunk;
 }
 
+// background compaction thread (started on first use), io is limited by budget
+struct compactor {
+    std::thread thread;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool running = false, wake = false;
+    std::atomic<size_t> budget = {32 * 1024 * 1024}; // bytes per second, 0 - disabled
+
+    ~compactor() {
+        shutdown();
+    }
+
+    void notify() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (budget == 0)
+            return;
+        if (!running) {
+            running = true;
+            _compactStop = false;
+            thread = std::thread([this]() { worker(); });
+        }
+        wake = true;
+        cv.notify_one();
+    }
+
+    void shutdown() {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!running)
+            return;
+        _compactStop = true;
+        cv.notify_one();
+        lock.unlock();
+        thread.join();
+        lock.lock();
+        running = false;
+        _compactStop = false;
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!_compactStop) {
+            cv.wait(lock, [this]() { return wake || _compactStop; });
+            wake = false;
+            lock.unlock();
+
+            std::vector<string> paths;
+            {
+                std::shared_lock<std::shared_mutex> vlock(_vfsLock);
+                for (const auto &v : _vfs)
+                    paths.push_back(v.first);
+            }
+            for (const auto &path : paths) {
+                bool done = false;
+                while (!done && !_compactStop) {
+                    uint64 moved = 0;
+                    {
+                        std::lock_guard<std::mutex> clock(_compactLock);
+                        std::shared_lock<std::shared_mutex> vlock(_vfsLock);
+                        auto v = _vfs.find(path);
+                        if (v == _vfs.end() || v->second.f == NULL)
+                            break;
+                        moved = _vfs_compact_step(v->second, done);
+                    }
+
+                    // keep io under budget
+                    size_t b = budget;
+                    if (moved > 0 && b > 0) {
+                        std::unique_lock<std::mutex> wlock(mtx);
+                        cv.wait_for(wlock, std::chrono::microseconds(moved * 1000000 / b), [this]() { return (bool)_compactStop; });
+                    }
+                }
+            }
+            lock.lock();
+        }
+    }
+} _compactor;
+
 // (re) opens/creates vfs, initializes index
 void _vfs_open(const string path) {
     if (!_exists_file(path)) {
@@ -297,34 +1837,41 @@ void _vfs_open(const string path) {
         #endif
 
         // create and initialize new vfs
-        uint32 filesCount = 0;
-        vfs v;
+        _vfs.erase(path);
+        vfs &v = _vfs[path];
         v.f = std::fopen(path.c_str(), "wb+");
         if (v.f == NULL) {
+            _vfs.erase(path);
             const char *e = strerror(errno);
             gassertl(false, strs("vfs create: could not open file: ", path, "for write, errno: ", e));
             return;
         }
-        v.indexOffset = 4 + sizeof(uint64);
+        v.indexOffset = v.manifestOffset = _vfsHeaderSize;
         v.dirty = false;
+        v.journalPath = path + ".journal";
+        v.journaling = _journal;
+        std::remove(v.journalPath.c_str()); // left by previous archive
         size_t chunksWritten = 0;
-        chunksWritten += std::fwrite("GFS2", 4, 1, v.f);
+        chunksWritten += std::fwrite("GFS4", 4, 1, v.f);
         chunksWritten += std::fwrite(&v.indexOffset, sizeof(uint64), 1, v.f);
-        chunksWritten += std::fwrite(&filesCount, sizeof(uint32), 1, v.f);
         const char *e = strerror(errno);
-        gassertl(chunksWritten == 3, strs("vfs create: could not write to file: ", path, " errno: ", e));
-        _vfs[path] = v;
+        gassertl(chunksWritten == 2, strs("vfs create: could not write to file: ", path, " errno: ", e));
+        _vfs_write_index(v);
+        v.indexOffset = std::ftell(v.f);
+        v.manifestSize = v.indexOffset - v.manifestOffset;
+        std::fflush(v.f);
     }
     else {
         auto vt = _vfs.find(path);
         if (vt == _vfs.end()) {
             // create index
-            uint32 filesCount = 0;
-            vfs v;
+            vfs &v = _vfs[path];
             stream s;
             size_t size;
+            bool valid;
             v.f = std::fopen(path.c_str(), "rb+");
             if (v.f == NULL) {
+                _vfs.erase(path);
                 const char *e = strerror(errno);
                 gassert(false, strs("vfs open: could not open file: ", path, " errno: ", e));
                 (void)e; // supress warning
@@ -335,40 +1882,60 @@ void _vfs_open(const string path) {
             // read and validate header
             char id[4];
             if (1 != std::fread(id, 4, 1, v.f)) goto signalError;
-            if (id[0] != 'G' || id[1] != 'F' || id[2] != 'S' || id[3] != '2') {
+            if (id[0] != 'G' || id[1] != 'F' || id[2] != 'S' || (id[3] != '2' && id[3] != '4')) {
                 std::fclose(v.f);
+                _vfs.erase(path);
                 gassert(false, strs("vfs open: not an vfs archive: ", path));
                 return;
             }
             if (1 != std::fread(&v.indexOffset, sizeof(uint64), 1, v.f)) goto signalError;
 
-            // read file index in one chunk
+            // read file index in one chunk (new files are appended after it), GFS4 index is mapped if possible
             if (0 != std::fseek(v.f, 0, SEEK_END)) goto signalError;
-            size = std::ftell(v.f) - v.indexOffset;
-            if (0 != std::fseek(v.f, (long)v.indexOffset, SEEK_SET)) goto signalError;
-            s.resize(size);
-            if (1 != std::fread(s.data(), size, 1, v.f)) goto signalError;
-
-            // read index
-            s.read(filesCount);
-            while (filesCount-- > 0) {
-                vfs_file fi;
-                s.read(fi.id);
-                s.read(fi.position);
-                s.read(fi.size);
-                s.read(fi.flags);
-                s.read(fi.createTime);
-                s.read(fi.modTime);
-                v.files.push_back(fi);
+            v.manifestOffset = v.indexOffset;
+            v.indexOffset = std::ftell(v.f);
+            if (v.manifestOffset > v.indexOffset) goto signalError;
+            size = v.indexOffset - v.manifestOffset;
+            if (id[3] == '4') {
+                auto m = _mapShared(v.f);
+                if (m && m->size() >= v.indexOffset)
+                    s = stream(m->data() + v.manifestOffset, size, m);
+            }
+            if (s.size() < size) {
+                if (0 != std::fseek(v.f, (long)v.manifestOffset, SEEK_SET)) goto signalError;
+                s.resize(size);
+                if (1 != std::fread(s.data(), size, 1, v.f)) goto signalError;
+            }
+
+            // read index (GFS4 index is searched in place, files are decoded on access)
+            if (id[3] == '4')
+                valid = _vfs_open_table(v, std::move(s));
+            else if ((valid = _vfs_read_index_v2(s, v))) {
+                v.manifestSize = s.getPos();
+                _vfs_index_build(v);
+            }
+            if (!valid) {
+                std::fclose(v.f);
+                _vfs.erase(path);
+                gassertl(false, strs("vfs open: corrupted index: ", path));
+                return;
             }
 
-            // store index in map
-            _vfs[path] = v;
+            // changes made after index was written (crash in journaled mode)
+            v.journalPath = path + ".journal";
+            if (_vfs_journal_replay(v) > 0) {
+                v.journaling = true; // index is synced before journal is removed
+                _vfs_persist(v);
+            }
+            _vfs_journal_reset(v, !v.dirty);
+            v.journaling = _journal;
+            _compactor.notify();
             return;
 
             // print error to log
             signalError:
             std::fclose(v.f);
+            _vfs.erase(path);
             const char *e = strerror(errno);
             gassertl(false, strs("vfs open: error reading file: ", path, " errno: ", e));
             return;
@@ -381,132 +1948,146 @@ void _vfs_open(const string path) {
     }
 }
 
-// calculates fragmented data size
-uint64 _vfs_fragmented_size(vfs &v) {
-    return std::accumulate(v.removeQueue.begin(), v.removeQueue.end(), uint64(0),
-                           [](const auto &acc, const auto &e) {
-                               return acc + std::get<1>(e);
-                           });
-}
-
-// defragment file (collapse holes left by files removal)
-void _vfs_defragment(vfs &v) {
-    if (v.removeQueue.size() > 1) {
-        // sort
-        std::sort(v.removeQueue.begin(), v.removeQueue.end(),
-                  [](const auto &a, const auto &b) {
-                      return std::get<0>(a) < std::get<0>(b);
-                  });
-
-        // remove gaps
-        for (size_t i = 0; i < v.removeQueue.size() - 1; ) {
-            if (std::get<0>(v.removeQueue[i]) + std::get<1>(v.removeQueue[i]) == std::get<0>(v.removeQueue[i + 1])) {
-                std::get<1>(v.removeQueue[i]) += std::get<1>(v.removeQueue[i + 1]);
-                v.removeQueue.erase(v.removeQueue.begin() + i + 1);
-            }
-            else ++i;
-        }
-    }
-
-    // move file parts
-    stream buff(1024 * 1024);
-    uint64 totalRemoved = 0;
-    size_t size = v.removeQueue.size();
-    for (size_t i = 0; i < size; ++i) {
-        uint64 to = std::get<0>(v.removeQueue[i]);
-        uint64 from = to + std::get<1>(v.removeQueue[i]);
-        uint64 count = i + 1 == size ? -1 : (std::get<0>(v.removeQueue[i + 1]) - from);
-        uint64 readed = 1;
-
-        while (readed != 0) {
-            std::fseek(v.f, (long)from, SEEK_SET);
-            readed = std::fread(buff.data(), 1, std::min(buff.size(), (size_t)count), v.f);
-            std::fseek(v.f, (long)to, SEEK_SET);
-            std::fwrite(buff.data(), readed, 1, v.f);
-            to += readed;
-            from += readed;
-            count -= readed;
-        }
-
-        uint64 fPos = std::get<0>(v.removeQueue[i]);
-        uint64 fSize = std::get<1>(v.removeQueue[i]);
-        totalRemoved += fSize;
-
-        // update file index
-        for (auto &fi : v.files) {
-            if (fi.position > fPos)
-                fi.position -= fSize;
-        }
-    }
-
-    // clear queue
-    v.removeQueue.clear();
-
-    // update index offset
-    v.indexOffset -= totalRemoved;
-
-    // truncate file
-    std::fseek(v.f, 0, SEEK_END);
-    size_t currentSize = std::ftell(v.f);
-    _resize(v.f, currentSize - totalRemoved);
-}
-
 // close file handle
 void _vfs_close(vfs &v) {
-    _vfs_defragment(v);
-    if (v.dirty) {
-        std::fseek(v.f, (long)v.indexOffset, SEEK_SET);
-        _vfs_write_index(v);
-
-        // update header
-        std::fseek(v.f, 4, SEEK_SET);
-        if (1 != std::fwrite(&v.indexOffset, sizeof(uint32), 1, v.f)) {
-            const char *e = strerror(errno);
-            gassert(false, strs("could not close vfs: write failed, errno: ", e));
-            (void)e; // supress warning
-        }
-        v.dirty = false;
-    }
+    v.map.reset(); // views keep their own reference
+    if (v.dirty)
+        _vfs_persist(v);
+    _vfs_journal_reset(v, !v.dirty);
 
     std::fclose(v.f);
     v.f = NULL;
-}
-
-// search for file id in index
-std::vector<vfs_file>::iterator _vfs_find_file(vfs &v, const string &id) {
-    return std::find_if(v.files.begin(), v.files.end(),
-                        [&id](vfs_file &f) {
-                            return f.id == id;
-                        });
+    _cache.clear(&v);
 }
 
 // checks if file exists in archive index
 bool _vfs_exists(vfs &v, const string &id) {
-    return v.files.end() != _vfs_find_file(v, id);
+    return nullptr != _vfs_find_file(v, id);
+}
+
+// decompress single block file data (after real size)
+bool _decompressEntry(const vfs &v, const vfs_file &f, const uint8 *sc, size_t scSize, uint8 *out, int64 realSize) {
+    if (f.flags & vfs_dictionary) {
+        const stream &d = v.dictionary;
+        return LZ4_decompress_safe_usingDict((const char*)sc, (char*)out, (int)scSize, (int)realSize, (const char*)d.data(), (int)d.size()) == realSize;
+    }
+    return LZ4_decompress_safe((const char*)sc, (char*)out, (int)scSize, (int)realSize) == realSize;
+}
+
+// read file from archive mapping, decompresses directly from mapped memory,
+// uncompressed files are returned as views if output stream is empty
+bool _vfs_read_mapped(vfs &v, const vfs_file &f, stream &s) {
+    auto m = _vfs_mapping(v, f.position + f.size);
+    if (!m)
+        return false;
+    const uint8 *data = m->data() + f.position;
+    bool verify = _verifyChecksums && (f.flags & vfs_checksum);
+    if (verify && f.crc != crc32c(data, f.size)) {
+        logError(strs("vfs read: checksum mismatch: ", f.id));
+        s.resize(0);
+        return true;
+    }
+
+    if (f.flags & vfs_compressed) {
+        int64 realSize;
+        memcpy(&realSize, data, sizeof(int64));
+        const uint8 *sc = data + sizeof(int64);
+        uint64 scSize = f.size - sizeof(int64);
+        size_t offset = s.size();
+        s.resize(offset + realSize);
+        bool ok;
+        if (f.flags & vfs_frame) {
+            _frameReader.reset([&sc, &scSize](void *out, size_t size) {
+                size_t n = (size_t)std::min<uint64>(size, scSize);
+                memcpy(out, sc, n);
+                sc += n;
+                scSize -= n;
+                return n;
+            });
+            ok = _frameReader.read(s.data() + offset, realSize) == (size_t)realSize;
+        }
+        else ok = _decompressEntry(v, f, sc, scSize, s.data() + offset, realSize);
+        if (!ok) {
+            logError("vfs read: could decompress data");
+            s.resize(0);
+        }
+    }
+    else if (s.size() == 0)
+        s = stream(data, f.size, std::shared_ptr<void>(m, (void*)data)); // zero copy
+    else s.write(data, f.size);
+    return true;
 }
 
 // read file from archive to stream, returns empty stream if failed
+// (positional reads only - may be called concurrently with shared lock on vfs)
 void _vfs_read(vfs &v, const string &id, stream &s) {
     auto f = _vfs_find_file(v, id);
-    gassert(f != v.files.end(), strs("vfs file: ", id, " not found"));
-    if (f != v.files.end()) {
-        std::fseek(v.f, (long)f->position, SEEK_SET);
+    gassert(f != nullptr, strs("vfs file: ", id, " not found"));
+    if (f != nullptr) {
+        if (_mapArchives && _vfs_read_mapped(v, *f, s))
+            return;
 
-        if (f->flags & 1) {
-            // decompress
+        bool verify = _verifyChecksums && (f->flags & vfs_checksum);
+        uint32 crc = 0;
+
+        if (f->flags & vfs_frame) {
+            // decompress block by block, only one compressed block is held in memory
             int64 realSize = 0;
-            if (1 != std::fread(&realSize, sizeof(int64), 1, v.f)) {
+            if (!_pread(v.f, &realSize, sizeof(int64), f->position)) {
                 logError("vfs read: could not read compressed data size");
                 return;
             }
-            stream sc(f->size - sizeof(int64));
-            if (1 != std::fread(sc.data(), sc.size(), 1, v.f)) {
+            if (verify)
+                crc = crc32c(&realSize, sizeof(int64));
+            uint64 offset = f->position + sizeof(int64);
+            uint64 left = f->size - sizeof(int64);
+            _frameReader.reset([&v, &offset, &left, &crc, verify](void *data, size_t size) -> size_t {
+                size_t n = (size_t)std::min<uint64>(size, left);
+                if (!_pread(v.f, data, n, offset))
+                    return 0;
+                if (verify)
+                    crc = crc32c(data, n, crc);
+                offset += n;
+                left -= n;
+                return n;
+            });
+            size_t sOffset = s.size();
+            s.resize(sOffset + realSize);
+            if (_frameReader.read(s.data() + sOffset, realSize) != (size_t)realSize) {
+                logError("vfs read: could decompress data");
+                s.resize(0);
+                return;
+            }
+            if (verify) {
+                // drain end mark, block table follows
+                uint8 end;
+                _frameReader.read(&end, 1);
+                if (left > 0) {
+                    stream &t = _readBuffer;
+                    t.resize((size_t)left);
+                    if (_pread(v.f, t.data(), t.size(), offset))
+                        crc = crc32c(t, crc);
+                }
+            }
+        }
+        else if (f->flags & vfs_compressed) {
+            // decompress
+            int64 realSize = 0;
+            stream &sc = _readBuffer;
+            sc.resize(f->size);
+            if (!_pread(v.f, sc.data(), f->size, f->position)) {
                 logError("vfs read: could not read compressed data");
                 return;
             }
+            memcpy(&realSize, sc.data(), sizeof(int64));
+            if (verify && f->crc != crc32c(sc)) {
+                logError(strs("vfs read: checksum mismatch: ", id));
+                return;
+            }
+            verify = false;
             size_t offset = s.size();
             s.resize(offset + realSize);
-            if (LZ4_decompress_safe((const char*)sc.data(), (char*)s.data() + offset, (int)sc.size(), (int)realSize) < 0) {
+            if (!_decompressEntry(v, *f, sc.data() + sizeof(int64), sc.size() - sizeof(int64), s.data() + offset, realSize)) {
                 logError("vfs read: could decompress data");
                 s.resize(0);
             }
@@ -515,32 +2096,56 @@ void _vfs_read(vfs &v, const string &id, stream &s) {
             // read
             size_t offset = s.size();
             s.resize(offset + f->size);
-            if (1 != std::fread(s.data() + offset, f->size, 1, v.f)) {
+            if (!_pread(v.f, s.data() + offset, f->size, f->position)) {
                 logError("vfs read: could not read data");
                 s.resize(0);
+                return;
             }
+            if (verify)
+                crc = crc32c(s.data() + offset, f->size);
+        }
+
+        if (verify && crc != f->crc) {
+            logError(strs("vfs read: checksum mismatch: ", id));
+            s.resize(0);
         }
     }
     else logError(strs("vfs read: file: ", id, " not found"));
 }
 
-// remove file from archive and index
-bool _vfs_remove(vfs &v, const string &id) {
-    auto f = _vfs_find_file(v, id);
-    if (f != v.files.end()) {
-        // add file to remove queue
-        v.removeQueue.push_back(std::make_tuple(f->position, f->size));
+// add file to index in place of file with same id (its data becomes hole), creation time is kept
+void _vfs_replace(vfs &v, vfs_file &&f) {
+    auto old = _vfs_find_file(v, f.id);
+    if (old != nullptr) {
+        f.createTime = old->createTime;
+        auto hole = std::make_tuple(old->position, old->size);
+        if (_vfs_erase_file(v, old) && std::get<0>(hole) != f.position) // data may be reused by new file (same content)
+            v.removeQueue.push_back(hole);
+        _compactor.notify();
+    }
+    _vfs_insert_file(v, std::move(f));
+    v.dirty = true;
+}
 
-        // remove from index
-        v.files.erase(f);
+// remove found file from archive and index
+void _vfs_remove(vfs &v, vfs_file *f) {
+    // hole is reclaimed later by compaction (data shared with other files stays)
+    auto hole = std::make_tuple(f->position, f->size);
+    if (_vfs_erase_file(v, f))
+        v.removeQueue.push_back(hole);
 
-        // if fragmented size exceeds given limit -> do deframentation
-        if (_vfs_fragmented_size(v) > 1024 * 1024 * 100) // 100MB
-            _vfs_defragment(v);
+    // mark index as dirty
+    v.dirty = true;
+    _compactor.notify();
+}
 
-        // mark index as dirty
-        v.dirty = true;
-        return true;
+// remove file from archive and index
+bool _vfs_remove(vfs &v, const string &id) {
+    _vfs_materialize(v);
+    auto f = _vfs_find_file(v, id);
+    if (f != nullptr) {
+        _vfs_remove(v, f);
+        return _vfs_journal_commit(v);
     }
     else {
         // report error
@@ -549,47 +2154,288 @@ bool _vfs_remove(vfs &v, const string &id) {
     }
 }
 
-// add/rename file to archive and index
-bool _vfs_add(vfs &v, const string &id, const const_stream &s, bool compress = true) {
-    auto f = _vfs_find_file(v, id);
+// checks if file type should be compressed
+bool _compressible(const string &id) {
+    return std::count(_doNotCompress.begin(), _doNotCompress.end(), extractExt(id)) == 0;
+}
 
-    // replace file (remove old file first)
-    uint64 createTime = std::time(0);
-    if (f != v.files.end()) {
-        _vfs_remove(v, id);
-        createTime = f->createTime; // preserve create time
+// compression profile for file
+const compression_profile &_compressionProfile(const string &id) {
+    auto p = _compressionProfiles.find(extractExt(id));
+    return p != _compressionProfiles.end() ? p->second : _compressionProfiles[""];
+}
+
+// compress lz4 frame block (uint32 compressedSize, data - see compress.hpp), blocks do not depend on each other,
+// returns false if failed (out is empty then)
+bool _compressBlock(const uint8 *data, size_t size, int level, stream &out) {
+    int bound = LZ4_compressBound((int)size);
+    out.resize(sizeof(uint32) + bound);
+    int compressedSize = bound > 0 ? lz4CompressBlock(data, (int)size, out.data() + sizeof(uint32), bound, level) : 0;
+    if (compressedSize <= 0) {
+        logError(strs("lz4 block compression failed, size: ", size));
+        out.resize(0);
+        return false;
     }
+    uint32 cs = (uint32)compressedSize;
+    memcpy(out.data(), &cs, sizeof(uint32));
+    out.resize(sizeof(uint32) + cs);
+    return true;
+}
 
-    // disable compression for some file types
-    if (compress) {
-        if (std::count(_doNotCompress.begin(), _doNotCompress.end(), extractExt(id)) > 0)
-            compress = false;
+// load regular file (big files are mapped instead of copied), returns false if failed
+bool _loadFile(const string &filepath, stream &s) {
+    std::FILE *f = std::fopen(filepath.c_str(), "rb");
+    if (f == NULL) {
+        const char *e = strerror(errno);
+        gassertl(false, strs("could not open file: ", filepath, " errno:", e));
+        return false;
     }
 
-    // create file
-    std::fseek(v.f, (long)v.indexOffset, SEEK_SET);
-    if (compress) {
-        stream sc(LZ4_compressBound((int)s.size()));
-        uint64 compressedSize = LZ4_compress_default((const char*)s.data(), (char*)sc.data(), (int)s.size(), (int)sc.size());
-        int64 realSize = s.size();
-        size_t chunksWritten = 0;
-        chunksWritten = std::fwrite(&realSize, sizeof(int64), 1, v.f);
-        chunksWritten += std::fwrite(sc.data(), compressedSize, 1, v.f);
-        if (chunksWritten != 2) goto writeError;
-        v.files.push_back({id, v.indexOffset, compressedSize + sizeof(int64), 1, createTime, (uint64)std::time(0)});
+    std::fseek(f, 0, SEEK_END);
+    size_t size = std::ftell(f);
+    std::rewind(f);
+
+    if (_mapThreshold > 0 && size >= _mapThreshold && _map(filepath, s)) {
+        std::fclose(f);
+        return true;
     }
-    else {
-        if (1 != std::fwrite(s.data(), s.size(), 1, v.f)) goto writeError;
-        v.files.push_back({id, v.indexOffset, s.size(), 0, createTime, (uint64)std::time(0)});
+
+    s.resize(size);
+    bool readed = io_engine::local().read(_fd(f), s.data(), size, 0);
+    const char *e = strerror(errno);
+    gassertl(readed, strs("read file failed: ", filepath, " errno: ", e));
+
+    std::fclose(f);
+    if (!readed)
+        s = stream();
+    return readed;
+}
+
+// file packed to archive, data is loaded by first producer of its blocks and released after write
+struct pack_file {
+    string path, id;
+    uint64 size;
+    bool compress;
+    compression_profile profile;
+    size_t firstUnit, units; // frame files have one unit per block
+    std::once_flag loaded;
+    stream data; // loaded from path (if not empty) on first use
+    digest128 content = {0, 0}; // hash128 of data (deduplication)
+    bool duplicate = false; // same content is already in archive (not compressed)
+    bool failed = false; // could not be read
+    std::atomic<bool> broken = {false}; // frame block could not be compressed (file is not stored)
+};
+
+// add files to archive (appendLock held, vfs not locked), reading and compression runs in parallel without
+// lock, data is written sequentially at the end of archive and vfs is locked for write only to add written file
+// to index (replaced file stays until then), files with content already in archive share its data (deduplication enabled),
+// dictionary is used instead of archive dictionary if set, written files are returned in added instead of being
+// added to index if it is set (no deduplication then)
+bool _vfs_pack(vfs &v, std::vector<pack_file> &files, const stream *dictionary = nullptr, std::vector<vfs_file> *added = nullptr) {
+    {
+        std::unique_lock<std::shared_mutex> lock(v.lock);
+        _vfs_materialize(v);
+    }
+    const stream &dict = dictionary != nullptr ? *dictionary : v.dictionary; // not changed while packing (appendLock is held)
+
+    // plan work units
+    size_t unitsCount = 0;
+    std::vector<size_t> unitFile;
+    for (size_t i = 0; i < files.size(); ++i) {
+        pack_file &pf = files[i];
+        pf.compress = pf.compress && _compressible(pf.id);
+        pf.profile = _compressionProfile(pf.id);
+        pf.profile.dictionary = pf.profile.dictionary && dict.size() > 0;
+        pf.units = pf.compress && pf.size >= _frameThreshold ? (size_t)((pf.size + _frameBlockSize - 1) / _frameBlockSize) : 1;
+        pf.firstUnit = unitsCount;
+        unitsCount += pf.units;
+        unitFile.resize(unitsCount, i);
+    }
+
+    size_t window = 2 * _workersCount();
+    std::vector<stream> out(window);
+    std::vector<uint32> outCrc(window); // crc32c of compressed frame block
+    std::vector<uint32> tableCrc; // block checksums of current frame file
+    uint64 offset = v.indexOffset, position = offset, size = 0; // only appender changes end of data
+    uint32 crc = 0;
+    bool written = true;
+    std::vector<uint64> table; // block offsets of current frame file
+    bool duplicate = false; // current file shares data of file already in archive (added to index)
+    bool raw = false; // current file was not compressed (shared data was removed meanwhile), stored as is
+    bool dropped = false; // current file could not be compressed, its units are skipped
+    bool incomplete = false; // some files were not stored (could not be read or compressed)
+    std::fseek(v.f, (long)offset, SEEK_SET);
+
+    auto write = [&v, &offset, &size, &crc, &written](const void *data, size_t bytes) {
+        written = written && (bytes == 0 || 1 == std::fwrite(data, bytes, 1, v.f));
+        crc = crc32c(data, bytes, crc);
+        offset += bytes;
+        size += bytes;
+    };
+
+    _pipeline(unitsCount, window,
+              [&v, &files, &unitFile, &out, &outCrc, &dict, added, window](size_t i) {
+                  pack_file &pf = files[unitFile[i]];
+                  std::call_once(pf.loaded, [&v, &pf, added]() {
+                      if (!pf.path.empty())
+                          pf.failed = !_loadFile(pf.path, pf.data) || (pf.units > 1 && pf.data.size() != pf.size);
+                      if (!pf.failed && _deduplicate && added == nullptr) {
+                          pf.content = hash128(pf.data);
+                          std::shared_lock<std::shared_mutex> lock(v.lock);
+                          pf.duplicate = v.contents.count(pf.content) > 0;
+                      }
+                  });
+                  const stream &d = pf.data; // const access does not copy views
+                  stream &o = out[i % window];
+                  o.resize(0);
+                  if (pf.failed || !pf.compress || pf.duplicate)
+                      return;
+                  if (pf.units > 1) {
+                      size_t block = (i - pf.firstUnit) * _frameBlockSize;
+                      if (!_compressBlock(d.data() + block, std::min<size_t>(_frameBlockSize, d.size() - block), pf.profile.level, o))
+                          pf.broken = true;
+                      else outCrc[i % window] = crc32c(o.data() + sizeof(uint32), o.size() - sizeof(uint32));
+                      return;
+                  }
+                  int64 realSize = d.size();
+                  o.resize(sizeof(int64) + LZ4_compressBound((int)realSize));
+                  memcpy(o.data(), &realSize, sizeof(int64));
+                  int compressedSize = lz4CompressBlock(d.data(), (int)realSize, o.data() + sizeof(int64), (int)o.size() - (int)sizeof(int64),
+                                                        pf.profile.level, pf.profile.dictionary ? dict.data() : nullptr, (int)dict.size());
+                  if (compressedSize > 0)
+                      o.resize(sizeof(int64) + compressedSize);
+                  else {
+                      // stored uncompressed (only producer of this file)
+                      logError(strs("lz4 compression failed, stored uncompressed: ", pf.id));
+                      pf.compress = false;
+                      o.resize(0);
+                  }
+              },
+              [&](size_t i) {
+                  pack_file &pf = files[unitFile[i]];
+                  if (pf.failed || !written) {
+                      incomplete = true;
+                      pf.data = stream();
+                      return;
+                  }
+                  const stream &o = out[i % window];
+                  const stream &d = pf.data;
+
+                  // file begins (duplicate of file added before is found here too)
+                  if (i == pf.firstUnit) {
+                      position = offset;
+                      size = 0;
+                      crc = 0;
+                      table.clear();
+                      tableCrc.clear();
+                      duplicate = false;
+                      dropped = false;
+                      if (!pf.content.empty()) {
+                          std::unique_lock<std::shared_mutex> lock(v.lock);
+                          auto c = v.contents.find(pf.content);
+                          duplicate = c != v.contents.end();
+                          if (duplicate) {
+                              const vfs_file &shared = *_vfs_find_file(v, c->second);
+                              _vfs_replace(v, {pf.id, shared.position, shared.size, shared.flags, (uint64)std::time(0),
+                                               (uint64)std::time(0), shared.crc, pf.content});
+                          }
+                      }
+                      raw = pf.duplicate && !duplicate;
+                      if (raw)
+                          write(d.data(), d.size());
+                      else if (!duplicate && pf.units > 1) {
+                          int64 realSize = pf.size;
+                          uint32 blockSize = (uint32)_frameBlockSize;
+                          write(&realSize, sizeof(int64));
+                          write(&blockSize, sizeof(uint32));
+                      }
+                  }
+
+                  bool last = i + 1 == pf.firstUnit + pf.units;
+                  if (!dropped && pf.broken) {
+                      logError(strs("vfs pack: could not compress: ", pf.id, ", file is not stored"));
+                      dropped = incomplete = true;
+                  }
+                  if (dropped) {
+                      // data written so far becomes hole, replaced file stays
+                      if (last) {
+                          std::unique_lock<std::shared_mutex> lock(v.lock);
+                          if (offset > position)
+                              v.removeQueue.push_back(std::make_tuple(position, offset - position));
+                          v.indexOffset = offset;
+                          pf.data = stream();
+                      }
+                      return;
+                  }
+                  if (duplicate || raw) {
+                      if (last && raw)
+                          pf.compress = false;
+                      else {
+                          if (last)
+                              pf.data = stream();
+                          return;
+                      }
+                  }
+                  else {
+                      if (pf.units > 1) {
+                          table.push_back(size);
+                          tableCrc.push_back(outCrc[i % window]);
+                      }
+                      if (pf.compress)
+                          write(o.data(), o.size());
+                      else write(d.data(), d.size());
+                  }
+
+                  // file ends
+                  if (last) {
+                      bool frame = pf.units > 1 && !raw;
+                      uint8 flags = vfs_checksum | (pf.compress && pf.profile.level > 0 ? vfs_hc : 0);
+                      if (frame) {
+                          uint32 endMark = 0;
+                          uint32 blocksCount = (uint32)table.size() | _blockCrcs;
+                          write(&endMark, sizeof(uint32));
+                          write(tableCrc.data(), tableCrc.size() * sizeof(uint32));
+                          write(table.data(), table.size() * sizeof(uint64));
+                          write(&blocksCount, sizeof(uint32));
+                          flags |= vfs_compressed | vfs_frame | vfs_independent | vfs_block_table;
+                      }
+                      else if (pf.compress)
+                          flags |= vfs_compressed | (pf.profile.dictionary ? vfs_dictionary : 0);
+                      written = written && 0 == std::fflush(v.f); // readers use positional reads (bypass file buffer)
+                      if (written) {
+                          std::unique_lock<std::shared_mutex> lock(v.lock);
+                          vfs_file f = {pf.id, position, size, flags, (uint64)std::time(0), (uint64)std::time(0), crc, pf.content};
+                          if (added != nullptr)
+                              added->push_back(std::move(f));
+                          else _vfs_replace(v, std::move(f));
+                          v.indexOffset = offset;
+                      }
+                      pf.data = stream();
+                  }
+              });
+
+    std::unique_lock<std::shared_mutex> lock(v.lock);
+    if (!written) {
+        // files written so far are valid, index starts after last of them (replaced files are kept)
+        const char *e = strerror(errno);
+        gassertl(false, strs("error: could not write files to vfs, errno: ", e));
+        offset = position;
     }
-    v.indexOffset = std::ftell(v.f);
+    v.indexOffset = offset;
+    std::fflush(v.f);
     v.dirty = true;
-    return true;
+    return _vfs_journal_commit(v) && written && !incomplete;
+}
 
-    writeError:
-    const char *e = strerror(errno);
-    gassertl(false, strs("error: could not write file to vfs: ", id, " errno: ", e));
-    return false;
+// add/rename file to archive and index (appendLock held)
+bool _vfs_add(vfs &v, const string &id, const const_stream &s, bool compress = true) {
+    std::vector<pack_file> files(1);
+    pack_file &pf = files[0];
+    pf.id = id;
+    pf.size = s.size();
+    pf.compress = compress;
+    pf.data = stream(s.data(), s.size(), nullptr); // view, not copied
+    return _vfs_pack(v, files);
 }
 
 // returns full path to file, vfs id, is vfs, is valid
@@ -642,16 +2488,91 @@ std::tuple<string, string, bool, bool> _resolveLocation(const string &ipath, dir
     return std::make_tuple("", "", false, false);
 }
 
-// file op
+// read order key for batch loads: <archive, data position> or <"", inode> for regular files
+std::tuple<string, uint64> _loadOrderKey(const string &path, directoryType type) {
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
+    bool vfs, valid;
+    string filepath, id;
+    std::tie(filepath, id, vfs, valid) = _resolveLocation(path, type, true);
+
+    if (vfs) {
+        auto v = _vfs.find(filepath);
+        if (v != _vfs.end()) {
+            std::shared_lock<std::shared_mutex> vlock(v->second.lock);
+            auto f = _vfs_find_file(v->second, id);
+            if (f != nullptr)
+                return std::make_tuple(filepath, f->position);
+        }
+    }
+    #ifndef GE_PLATFORM_WINDOWS
+    else if (valid) {
+        struct stat st;
+        if (stat(filepath.c_str(), &st) == 0)
+            return std::make_tuple("", (uint64)st.st_ino);
+    }
+    #endif
+    return std::make_tuple("", 0);
+}
+
+
+// batch load state, shared by loader threads (outlives caller if it does not wait)
+struct load_batch {
+    std::vector<string> paths;
+    directoryType type;
+    std::vector<size_t> order; // indices to paths in read order
+    std::function<void(size_t, stream &&)> done;
+    std::atomic<size_t> next = {0}, finished = {0};
+    std::mutex mtx;
+    std::condition_variable cv;
+
+    void run() {
+        for (size_t i; (i = next++) < order.size(); ) {
+            done(order[i], load(paths[order[i]], type));
+            if (++finished == order.size()) {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.notify_all();
+            }
+        }
+    }
+};
+
+// loads files on loader threads in data order (less seeking, archive reads go forward),
+// caller thread helps and waits for all if wait is set, done is called for every file
+void _loadBatch(const std::vector<string> &paths, directoryType type, std::function<void(size_t, stream &&)> done, bool wait) {
+    if (paths.empty())
+        return;
+    auto b = std::make_shared<load_batch>();
+    b->paths = paths;
+    b->type = type;
+    b->done = std::move(done);
+
+    std::vector<std::tuple<string, uint64>> keys(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i)
+        keys[i] = _loadOrderKey(paths[i], type);
+    b->order.resize(paths.size());
+    std::iota(b->order.begin(), b->order.end(), 0);
+    std::stable_sort(b->order.begin(), b->order.end(), [&keys](size_t a, size_t c) { return keys[a] < keys[c]; });
+
+    size_t helpers = std::min(paths.size(), _workersCount());
+    for (size_t i = 0; i < helpers; ++i)
+        _loader.schedule([b]() { b->run(); });
+
+    if (wait) {
+        b->run();
+        std::unique_lock<std::mutex> lock(b->mtx);
+        while (b->finished < b->order.size())
+            b->cv.wait(lock);
+    }
+}
+
+// query listing index of archive
 template <typename T_OP>
-void _vfs_files_op(const string &filepath, const string &id, T_OP op) {
-    fileList r;
+void _vfs_listing_op(const string &filepath, T_OP op) {
     auto v = _vfs.find(filepath);
     gassert(v != _vfs.end(), strs("vfs index not found: ", filepath));
     if (v != _vfs.end()) {
-        for (const auto &f : v->second.files) {
-            op(f);
-        }
+        std::shared_lock<std::shared_mutex> vlock(v->second.lock);
+        op(*_vfs_listing(v->second));
     }
 }
 }
@@ -726,10 +2647,53 @@ void doNotCompress(std::vector<string> extensions) {
     _doNotCompress = extensions;
 }
 
+void compressionProfile(const string &extension, int level, bool useDictionary) {
+    _compressionProfiles[extension] = {std::min(std::max(level, 0), 12), useDictionary};
+}
+
 void allowGlobalPaths(bool doAllow) {
     _allowGlobal = doAllow;
 }
 
+void memoryMapThreshold(size_t bytes) {
+    _mapThreshold = bytes;
+}
+
+void verifyChecksums(bool doVerify) {
+    _verifyChecksums = doVerify;
+}
+
+void journalArchives(bool doJournal) {
+    _journal = doJournal;
+}
+
+void deduplicateArchives(bool doDeduplicate) {
+    _deduplicate = doDeduplicate;
+}
+
+void memoryMapArchives(bool doMap) {
+    _mapArchives = doMap;
+}
+
+void compactionBudget(size_t bytesPerSecond) {
+    _compactor.budget = bytesPerSecond;
+}
+
+void archiveCacheSize(size_t bytes) {
+    _cache.capacity = bytes;
+    _cache.clear();
+}
+
+archiveCacheStats getArchiveCacheStats() {
+    archiveCacheStats r = {_cache.hits, _cache.misses, 0, 0, _cache.capacity};
+    for (auto &sh : _cache.shards) {
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        r.size += sh.size;
+        r.files += sh.entries.size();
+    }
+    return r;
+}
+
 void createFolderTree(const string &path) {
     #ifdef GE_PLATFORM_WINDOWS
     string normalizedPath = _normalizePath(path);
@@ -741,6 +2705,7 @@ void createFolderTree(const string &path) {
 
 // flush all archives (writes file index for all archives)
 void flush() {
+    std::unique_lock<std::shared_mutex> lock(_vfsLock);
     for (auto &v : _vfs) {
         _vfs_close(v.second);
         _vfs_open(v.first);
@@ -750,26 +2715,191 @@ void flush() {
 // create archive file
 bool createArchive(const string &path, directoryType type) {
     string fpath = fullPath(type, path);
+    std::unique_lock<std::shared_mutex> lock(_vfsLock);
     if (_exists_file(fpath))
         return false;
     _vfs_open(fpath);
     return true;
 }
 
+// add all files from directory to archive (archive is created/initialized if needed),
+// file ids are relative to given directory
+bool packDirectory(const string &dir, const string &archive, directoryType type, bool compress) {
+    string apath = fullPath(type, archive);
+    string base = fullPath(type);
+    {
+        std::unique_lock<std::shared_mutex> lock(_vfsLock);
+        if (_vfs.count(apath) == 0)
+            _vfs_open(apath);
+    }
+
+    // list files (stat gives sizes to split work before reading)
+    std::vector<std::tuple<string, string, uint64>> found;
+    for (const auto &fi : _filterFileListR(base, dir, [](fileInfo &fi) { return !fi.dir; }, false)) {
+        string rpath = fi.path == "" ? fi.name : fi.path + GE_DIR_SEPARATOR + fi.name;
+        string id = dir == "" ? rpath : rpath.substr(std::min(rpath.size(), dir.size() + 1));
+        findAndReplace(id, "\\", "/");
+        struct stat st;
+        if (base + rpath != apath && stat((base + rpath).c_str(), &st) == 0)
+            found.push_back(std::make_tuple(base + rpath, id, (uint64)st.st_size));
+    }
+
+    // pack files are not movable, constructed once
+    std::vector<pack_file> files(found.size());
+    for (size_t i = 0; i < found.size(); ++i) {
+        std::tie(files[i].path, files[i].id, files[i].size) = found[i];
+        files[i].compress = compress;
+    }
+
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
+    auto v = _vfs.find(apath);
+    if (v == _vfs.end()) {
+        gassertl(false, strs("could not pack: ", dir, " to vfs: ", archive, ", archive not initialized"));
+        return false;
+    }
+    std::lock_guard<std::mutex> alock(v->second.appendLock); // readers are blocked only while files are added to index
+    return _vfs_pack(v->second, files);
+}
+
+// train archive dictionary on samples (any loadable files)
+bool trainArchiveDictionary(const string &archive, const std::vector<string> &samples, directoryType type) {
+    std::vector<stream> data;
+    for (const auto &path : samples)
+        data.push_back(load(path, type));
+    stream dictionary = lz4TrainDictionary(data);
+
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
+    auto v = _vfs.find(fullPath(type, archive));
+    if (v == _vfs.end()) {
+        gassertl(false, strs("could not train dictionary: archive: ", archive, " not initialized"));
+        return false;
+    }
+    vfs &vf = v->second;
+    std::lock_guard<std::mutex> alock(vf.appendLock);
+
+    // files compressed with old dictionary (data shared by files is recompressed once), readers use old
+    // dictionary until all of them are written with new one, then both are switched in one index update
+    std::vector<std::vector<vfs_file>> sharers;
+    {
+        std::unique_lock<std::shared_mutex> vlock(vf.lock);
+        _vfs_materialize(vf);
+        std::unordered_map<uint64, size_t> byPosition;
+        for (const auto &f : vf.files) {
+            if (!(f.flags & vfs_dictionary))
+                continue;
+            auto p = byPosition.emplace(f.position, sharers.size());
+            if (p.second)
+                sharers.emplace_back();
+            sharers[p.first->second].push_back(f);
+        }
+    }
+    std::vector<pack_file> files(sharers.size());
+    for (size_t i = 0; i < files.size(); ++i) {
+        const vfs_file &f = sharers[i].front();
+        std::shared_lock<std::shared_mutex> vlock(vf.lock);
+        _vfs_read(vf, f.id, files[i].data);
+        if (files[i].data.size() == 0 && f.size > sizeof(int64) + 1) {
+            // not switched, file would stay compressed with dictionary which is not stored anymore
+            gassertl(false, strs("could not train dictionary: archive: ", archive, ", could not read: ", f.id));
+            return false;
+        }
+        files[i].id = f.id;
+        files[i].size = files[i].data.size();
+        files[i].compress = true;
+    }
+    std::vector<vfs_file> added;
+    bool r = _vfs_pack(vf, files, &dictionary, &added) && added.size() == files.size();
+
+    std::unique_lock<std::shared_mutex> vlock(vf.lock);
+    if (!r) {
+        // old dictionary and files are kept, data written so far is hole
+        for (const auto &f : added)
+            vf.removeQueue.push_back(std::make_tuple(f.position, f.size));
+        vf.dirty = true;
+        logError(strs("could not train dictionary: archive: ", archive, ", files could not be recompressed"));
+        return false;
+    }
+
+    // not journaled - replayed recompressed files would not match dictionary on disk, index is written instead
+    bool journaling = vf.journaling;
+    vf.journaling = false;
+    vf.dictionary = std::move(dictionary);
+    for (size_t i = 0; i < added.size(); ++i) {
+        // all sharers are erased before new entries are added, so they share new data again
+        std::vector<vfs_file> replaced;
+        for (const auto &old : sharers[i]) {
+            auto f = _vfs_find_file(vf, old.id);
+            if (f == nullptr || f->position != old.position)
+                continue; // removed meanwhile
+            vfs_file n = added[i];
+            n.id = old.id;
+            n.createTime = old.createTime;
+            n.modTime = old.modTime;
+            n.content = old.content;
+            replaced.push_back(std::move(n));
+            if (_vfs_erase_file(vf, f))
+                vf.removeQueue.push_back(std::make_tuple(old.position, old.size));
+        }
+        if (replaced.empty())
+            vf.removeQueue.push_back(std::make_tuple(added[i].position, added[i].size));
+        for (auto &f : replaced)
+            _vfs_insert_file(vf, std::move(f));
+    }
+    vf.dirty = true;
+    _compactor.notify();
+    if (journaling) {
+        r = _vfs_persist(vf);
+        vf.journaling = true;
+    }
+    return r;
+}
+
+// compact archive on calling thread
+void compactArchive(const string &path, directoryType type) {
+    string fpath = fullPath(type, path);
+    bool done = false;
+    while (!done) {
+        std::lock_guard<std::mutex> clock(_compactLock);
+        std::shared_lock<std::shared_mutex> lock(_vfsLock);
+        auto v = _vfs.find(fpath);
+        if (v == _vfs.end()) {
+            gassertl(false, strs("could not compact: ", path, ", archive not initialized"));
+            return;
+        }
+        vfs &vf = v->second;
+        if (!vf.compacting) {
+            // regardless of holes size
+            vf.compacting = true;
+            vf.compactGeneration = ~uint64(0);
+        }
+        _vfs_compact_step(vf, done);
+    }
+}
+
 // initialize archive (archive must be initialized first, before use)
 void initArchive(const string &path, directoryType type) {
+    std::unique_lock<std::shared_mutex> lock(_vfsLock);
     _vfs_open(fullPath(type, path));
 }
 
 // scan for vfs files and initialize all
 void initAllArchives(directoryType type) {
     fileList fl = matchFiles(".*\\.gfs", "", type);
+    std::unique_lock<std::shared_mutex> lock(_vfsLock);
     for (const auto &f : fl)
         _vfs_open(fullPath(type, f.fullPath()));
 }
 
 // close file system
 void close() {
+    if (_onLoaderThread) {
+        gassertl(false, "file system can not be closed from loader thread (load callback)");
+        return;
+    }
+    _loader.shutdown(); // finish pending async loads
+    _compactor.shutdown(); // unfinished compaction continues on next open
+    _journalSyncer.shutdown();
+    std::unique_lock<std::shared_mutex> lock(_vfsLock);
     for (auto &v : _vfs)
         _vfs_close(v.second);
     _vfs.clear();
@@ -777,23 +2907,29 @@ void close() {
 
 // list files in given directory
 fileList listFiles(const string &path, directoryType type) {
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
     bool vfs, valid;
     string filepath, id;
     std::tie(filepath, id, vfs, valid) = _resolveLocation(path, type, true);
 
     if (vfs) {
         fileList r;
-        _vfs_files_op(filepath, id,
-                      [&r, &id](auto &f) {
-                          string filePath = _vfs_extract_path(f.id);
-                          if (id == filePath)
-                              r.push_back({filePath, _vfs_extract_name(f.id), false, f.createTime, f.modTime});
-                          else {
-                              fileInfo fi = {_vfs_extract_path(filePath), _vfs_extract_name(filePath), true, f.createTime, f.modTime};
-                              if (id == fi.path && std::count(r.begin(), r.end(), fi) == 0)
-                                  r.push_back(fi);
-                          }
-                      });
+        _vfs_listing_op(filepath, [&r, &id](const vfs_listing &l) {
+            // files and first file of every subdirectory (rest of subdirectory is skipped)
+            size_t i, end, offset = id.empty() ? 0 : id.size() + 1;
+            std::tie(i, end) = _vfs_listing_subtree(l, id);
+            while (i < end) {
+                const auto &f = l.files[i];
+                size_t slash = f.id.find('/', offset);
+                if (slash == string::npos) {
+                    r.push_back({id, f.id.substr(offset), false, f.createTime, f.modTime});
+                    ++i;
+                    continue;
+                }
+                r.push_back({id, f.id.substr(offset, slash - offset), true, f.createTime, f.modTime});
+                i = _vfs_listing_subtree(l, f.id.substr(0, slash)).second;
+            }
+        });
         return r;
     }
 
@@ -801,18 +2937,21 @@ fileList listFiles(const string &path, directoryType type) {
 }
 
 fileList listFilesFlat(const string &path, directoryType type) {
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
     bool vfs, valid;
     string filepath, id;
     std::tie(filepath, id, vfs, valid) = _resolveLocation(path, type, true);
 
     if (vfs) {
         fileList r;
-        _vfs_files_op(filepath, id,
-                      [&r, &id](auto &f) {
-                          fileInfo fi = {_vfs_extract_path(f.id), _vfs_extract_name(f.id), false, f.createTime, f.modTime};
-                          if (!f.id.compare(0, id.size(), id) && std::count(r.begin(), r.end(), fi) == 0)
-                              r.push_back(fi);
-                      });
+        _vfs_listing_op(filepath, [&r, &id](const vfs_listing &l) {
+            size_t first, last;
+            std::tie(first, last) = _vfs_listing_subtree(l, id);
+            for (size_t i = first; i < last; ++i) {
+                const auto &f = l.files[i];
+                r.push_back({_vfs_extract_path(f.id), f.id.substr(f.name), false, f.createTime, f.modTime});
+            }
+        });
         return r;
     }
 
@@ -821,18 +2960,23 @@ fileList listFilesFlat(const string &path, directoryType type) {
 
 // find files resursively
 fileList findFiles(const string &name, const string &path, directoryType type) {
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
     bool vfs, valid;
     string filepath, id;
     std::tie(filepath, id, vfs, valid) = _resolveLocation(path, type, true);
 
     if (vfs) {
         fileList r;
-        _vfs_files_op(filepath, id,
-                      [&r, &name](auto &f) {
-                          string fName = _vfs_extract_name(f.id);
-                          if (name == fName)
-                              r.push_back({_vfs_extract_path(f.id), fName, false, f.createTime, f.modTime});
-                      });
+        _vfs_listing_op(filepath, [&r, &name, &id](const vfs_listing &l) {
+            // files with this name (ordered by id) filtered by directory
+            auto less = [&l](uint32 a, const string &n) { return l.files[a].id.compare(l.files[a].name, string::npos, n) < 0; };
+            auto i = std::lower_bound(l.byName.begin(), l.byName.end(), name, less);
+            for (; i != l.byName.end() && l.files[*i].id.compare(l.files[*i].name, string::npos, name) == 0; ++i) {
+                const auto &f = l.files[*i];
+                if (id.empty() || (f.name > id.size() && !f.id.compare(0, id.size(), id) && f.id[id.size()] == '/'))
+                    r.push_back({_vfs_extract_path(f.id), name, false, f.createTime, f.modTime});
+            }
+        });
         return r;
     }
 
@@ -840,29 +2984,45 @@ fileList findFiles(const string &name, const string &path, directoryType type) {
                             [&name](fileInfo &fi) { return name == fi.name; });
 }
 
-// match files by regex recursively
-fileList matchFiles(const string &regex, const string &path, directoryType type) {
+namespace {
+fileList _matchFiles(const pattern_matcher &m, const string &path, directoryType type) {
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
     bool vfs, valid;
     string filepath, id;
     std::tie(filepath, id, vfs, valid) = _resolveLocation(path, type, true);
 
     if (vfs) {
         fileList r;
-        _vfs_files_op(filepath, id,
-                      [&r, &regex](auto &f) {
-                          string fName = _vfs_extract_name(f.id);
-                          if (std::regex_match(fName, std::regex(regex)))
-                              r.push_back({_vfs_extract_path(f.id), fName, false, f.createTime, f.modTime});
-                      });
+        _vfs_listing_op(filepath, [&r, &m, &id](const vfs_listing &l) {
+            size_t first, last;
+            std::tie(first, last) = _vfs_listing_subtree(l, id);
+            for (size_t i = first; i < last; ++i) {
+                const auto &f = l.files[i];
+                if (m.match(f.id.data() + f.name, f.id.size() - f.name))
+                    r.push_back({_vfs_extract_path(f.id), f.id.substr(f.name), false, f.createTime, f.modTime});
+            }
+        });
         return r;
     }
 
     return _filterFileListR(fullPath(type), path,
-                            [&regex](fileInfo &fi) { return std::regex_match(fi.name, std::regex(regex)); });
+                            [&m](fileInfo &fi) { return m.match(fi.name); });
+}
+}
+
+// match files by regex recursively
+fileList matchFiles(const string &regex, const string &path, directoryType type) {
+    return _matchFiles(*pattern_matcher::cached(regex), path, type);
+}
+
+// match files by glob pattern recursively
+fileList globFiles(const string &glob, const string &path, directoryType type) {
+    return _matchFiles(*pattern_matcher::cached(glob, pattern_matcher::glob), path, type);
 }
 
 // load file/archive file to stream
 stream load(const string &path, directoryType type) {
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
     bool vfs, valid;
     string filepath, id;
     std::tie(filepath, id, vfs, valid) = _resolveLocation(path, type, true);
@@ -878,6 +3038,14 @@ stream load(const string &path, directoryType type) {
         auto v = _vfs.find(filepath);
         gassertl(v != _vfs.end(), strs("vfs index not found: ", path));
         if (v != _vfs.end()) {
+            std::shared_lock<std::shared_mutex> vlock(v->second.lock);
+            auto f = _vfs_find_file(v->second, id);
+            if (_cache.capacity > 0 && f != nullptr && (f->flags & vfs_compressed)) {
+                // decompressed files are shared (read only views, copied on write)
+                std::shared_ptr<stream> c = _cache.get(v->second, *f, [&v, &id](stream &s) { _vfs_read(v->second, id, s); });
+                const stream &cs = *c;
+                return stream(cs.data(), cs.size(), c);
+            }
             stream s;
             _vfs_read(v->second, id, s);
             return s;
@@ -886,37 +3054,274 @@ stream load(const string &path, directoryType type) {
     }
 
     // it's regular file - just load
-    std::FILE *f = std::fopen(filepath.c_str(), "rb");
-    if (f == NULL) {
-        const char *e = strerror(errno);
-        gassertl(false, strs("could not open file: ", path, " errno:", e));
-        return stream();
+    stream s;
+    _loadFile(filepath, s);
+    return s;
+}
+
+// load file on loader thread
+std::future<stream> loadAsync(const string &path, directoryType type) {
+    auto p = std::make_shared<std::promise<stream>>();
+    std::future<stream> r = p->get_future();
+    _loader.schedule([p, path, type]() { p->set_value(load(path, type)); });
+    return r;
+}
+
+void loadAsync(const string &path, loadCallback callback, directoryType type) {
+    _loader.schedule([path, callback, type]() {
+        stream s = load(path, type);
+        callback(path, s);
+    });
+}
+
+// load files in parallel, results are in paths order
+std::vector<stream> loadBatch(const std::vector<string> &paths, directoryType type) {
+    std::vector<stream> r(paths.size());
+    _loadBatch(paths, type, [&r](size_t i, stream &&s) { r[i] = std::move(s); }, true);
+    return r;
+}
+
+void loadBatch(const std::vector<string> &paths, loadCallback callback, directoryType type) {
+    auto p = std::make_shared<std::vector<string>>(paths);
+    _loadBatch(paths, type, [p, callback](size_t i, stream &&s) { callback((*p)[i], s); }, false);
+}
+
+// seekable reader state, archive files are looked up on every read (data may be moved by defragmentation)
+struct fileReader::state {
+    string archive, id; // archive file, empty for regular files
+    std::FILE *f = nullptr; // regular file
+    uint64 size = 0;
+    uint64 entrySize = 0; // identifies archive file version
+    uint32 entryCrc = 0;
+    bool whole = false; // decompressed on open (no block table)
+    stream data;
+    uint32 blockSize = 0;
+    std::vector<uint64> blocks; // block offsets from file data start, end mark offset at the end
+    std::vector<uint32> blockCrcs; // checksums of compressed blocks (empty if not stored)
+    size_t cached = ~size_t(0); // last decompressed block
+    stream block, compressed;
+    std::mutex mtx; // guards block cache
+
+    ~state() {
+        if (f != nullptr)
+            std::fclose(f);
     }
 
-    std::fseek(f, 0, SEEK_END);
-    size_t size = std::ftell(f);
-    std::rewind(f);
+    // read block offsets table (or walk block headers if there is no table), sizes and offsets
+    // read from archive are checked against entry size, false if they do not fit
+    bool readBlocks(vfs &v, const vfs_file &e) {
+        const uint64 header = sizeof(int64) + sizeof(uint32);
+        int64 realSize;
+        if (e.size < header || !_pread(v.f, &realSize, sizeof(int64), e.position) ||
+            !_pread(v.f, &blockSize, sizeof(uint32), e.position + sizeof(int64)) || blockSize == 0 || realSize < 0)
+            return false;
+        size = realSize;
+        uint64 count = (size + blockSize - 1) / blockSize;
+        if (count > (e.size - header) / sizeof(uint32)) // every block takes at least its size field
+            return false;
+        if (e.flags & vfs_block_table) {
+            uint32 tableCount;
+            if (!_pread(v.f, &tableCount, sizeof(uint32), e.position + e.size - sizeof(uint32)) || (tableCount & ~_blockCrcs) != count)
+                return false;
+            uint64 entrySize = sizeof(uint64) + ((tableCount & _blockCrcs) ? sizeof(uint32) : 0);
+            if (count * entrySize + sizeof(uint32) > e.size - header)
+                return false;
+            uint64 table = e.size - sizeof(uint32) - count * sizeof(uint64);
+            blocks.resize((size_t)count);
+            if (!_pread(v.f, blocks.data(), (size_t)count * sizeof(uint64), e.position + table))
+                return false;
+            if (tableCount & _blockCrcs) {
+                blockCrcs.resize((size_t)count);
+                table -= count * sizeof(uint32);
+                if (!_pread(v.f, blockCrcs.data(), (size_t)count * sizeof(uint32), e.position + table))
+                    return false;
+            }
+            for (size_t i = 0; i < blocks.size(); ++i) {
+                if (blocks[i] < (i == 0 ? header : blocks[i - 1] + sizeof(uint32)) || blocks[i] + sizeof(uint32) > table)
+                    return false;
+            }
+            blocks.push_back(count > 0 ? blocks.back() : header);
+            if (count > 0) {
+                uint32 csize;
+                if (!_pread(v.f, &csize, sizeof(uint32), e.position + blocks.back()))
+                    return false;
+                blocks.back() += sizeof(uint32) + csize;
+                if (blocks.back() > table)
+                    return false;
+            }
+        }
+        else {
+            uint64 offset = header;
+            for (size_t i = 0; i < count; ++i) {
+                uint32 csize;
+                if (offset + sizeof(uint32) > e.size || !_pread(v.f, &csize, sizeof(uint32), e.position + offset) || csize == 0)
+                    return false;
+                blocks.push_back(offset);
+                offset += sizeof(uint32) + csize;
+            }
+            if (offset > e.size)
+                return false;
+            blocks.push_back(offset);
+        }
+        return true;
+    }
 
-    stream s;
-    s.resize(size);
-    size_t readCount = std::fread(s.data(), size, 1, f);
-    const char *e = strerror(errno);
-    gassertl(readCount == 1 || size == 0, strs("read file failed: ", path, " errno: ", e));
+    // read range of archive file (vfs must be locked)
+    size_t readVfs(vfs &v, const vfs_file &e, uint64 offset, uint8 *out, size_t bytes) {
+        if (!(e.flags & vfs_compressed))
+            return _pread(v.f, out, bytes, e.position + offset) ? bytes : 0;
+
+        std::lock_guard<std::mutex> lock(mtx);
+        size_t r = 0;
+        while (r < bytes) {
+            size_t b = (size_t)((offset + r) / blockSize);
+            if (b != cached) {
+                cached = ~size_t(0);
+                size_t bsize = (size_t)std::min<uint64>(blockSize, size - (uint64)b * blockSize);
+                compressed.resize((size_t)(blocks[b + 1] - blocks[b] - sizeof(uint32)));
+                block.resize(bsize);
+                if (!_pread(v.f, compressed.data(), compressed.size(), e.position + blocks[b] + sizeof(uint32))) {
+                    logError(strs("file reader: could not read block of: ", id));
+                    break;
+                }
+                if (_verifyChecksums && !blockCrcs.empty() && blockCrcs[b] != crc32c(compressed)) {
+                    logError(strs("file reader: checksum mismatch: ", id, " block: ", b));
+                    break;
+                }
+                if (LZ4_decompress_safe((const char*)compressed.data(), (char*)block.data(), (int)compressed.size(), (int)bsize) != (int)bsize) {
+                    logError(strs("file reader: could not decompress block of: ", id));
+                    break;
+                }
+                cached = b;
+            }
+            size_t blockOffset = (size_t)(offset + r - (uint64)b * blockSize);
+            size_t n = std::min(bytes - r, block.size() - blockOffset);
+            memcpy(out + r, block.data() + blockOffset, n);
+            r += n;
+        }
+        return r;
+    }
+};
+
+fileReader::fileReader(std::shared_ptr<state> s) : _s(s) {}
+
+bool fileReader::valid() const {
+    return (bool)_s;
+}
+
+uint64 fileReader::size() const {
+    return _s ? _s->size : 0;
+}
+
+size_t fileReader::read(uint64 offset, void *data, size_t size) {
+    if (!_s || offset >= _s->size)
+        return 0;
+    size = (size_t)std::min<uint64>(size, _s->size - offset);
+    uint8 *out = (uint8*)data;
+
+    if (_s->whole) {
+        const stream &d = _s->data;
+        memcpy(out, d.data() + offset, size);
+        return size;
+    }
+    if (_s->f != nullptr)
+        return _pread(_s->f, out, size, offset) ? size : 0;
+
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
+    auto v = _vfs.find(_s->archive);
+    if (v == _vfs.end()) {
+        logError(strs("file reader: archive closed: ", _s->archive));
+        return 0;
+    }
+    std::shared_lock<std::shared_mutex> vlock(v->second.lock);
+    auto f = _vfs_find_file(v->second, _s->id);
+    if (f == nullptr || f->size != _s->entrySize || f->crc != _s->entryCrc) {
+        logError(strs("file reader: file removed or replaced: ", _s->id));
+        return 0;
+    }
+    return _s->readVfs(v->second, *f, offset, out, size);
+}
+
+stream fileReader::read(uint64 offset, size_t size) {
+    stream s(size);
+    s.resize(read(offset, s.data(), size));
+    return s;
+}
+
+// open file for random access reads
+fileReader openFile(const string &path, directoryType type) {
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
+    bool vfs, valid;
+    string filepath, id;
+    std::tie(filepath, id, vfs, valid) = _resolveLocation(path, type, true);
+    if (!valid) {
+        gassertl(false, strs("could not resolve file location: ", path));
+        return fileReader();
+    }
+
+    auto s = std::make_shared<fileReader::state>();
+    if (!vfs) {
+        s->f = std::fopen(filepath.c_str(), "rb");
+        if (s->f == NULL) {
+            const char *e = strerror(errno);
+            gassertl(false, strs("could not open file: ", path, " errno:", e));
+            return fileReader();
+        }
+        std::fseek(s->f, 0, SEEK_END);
+        s->size = std::ftell(s->f);
+        return fileReader(s);
+    }
 
-    std::fclose(f);
-    return s;
+    auto v = _vfs.find(filepath);
+    if (v == _vfs.end())
+        return fileReader();
+    std::shared_lock<std::shared_mutex> vlock(v->second.lock);
+    auto f = _vfs_find_file(v->second, id);
+    if (f == nullptr)
+        return fileReader();
+
+    s->archive = filepath;
+    s->id = id;
+    s->entrySize = f->size;
+    s->entryCrc = f->crc;
+    if (!(f->flags & vfs_compressed))
+        s->size = f->size;
+    else if (!(f->flags & vfs_independent) || !s->readBlocks(v->second, *f)) {
+        // linked blocks / single block - decompress whole file (verified by read)
+        s->blocks.clear();
+        s->blockCrcs.clear();
+        s->whole = true;
+        _vfs_read(v->second, id, s->data);
+        s->size = s->data.size();
+        if (s->data.size() == 0 && f->size > sizeof(int64) + 1) {
+            logError(strs("file reader: could not read: ", id));
+            return fileReader();
+        }
+        return fileReader(s);
+    }
+
+    // blocks with checksums are verified when read, files without them are checked once here
+    // (only small ones, bigger files are verified by load)
+    if (_verifyChecksums && s->blockCrcs.empty() && f->size <= _frameThreshold && !_vfs_verify(v->second, *f)) {
+        logError(strs("file reader: checksum mismatch: ", id));
+        return fileReader();
+    }
+    return fileReader(s);
 }
 
 // save stream to file/archive file
 bool store(const string &path, const_stream s, directoryType type, bool compress) {
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
     bool vfs, valid;
     string filepath, id;
     std::tie(filepath, id, vfs, valid) = _resolveLocation(path, type, false);
 
     if (vfs) {
         auto v = _vfs.find(filepath);
-        if (v != _vfs.end())
+        if (v != _vfs.end()) {
+            std::lock_guard<std::mutex> alock(v->second.appendLock);
             return _vfs_add(v->second, id, s, compress);
+        }
         gassertl(false, strs("could not write: ", path, " to vfs, probably archive not initialized"));
         return false;
     }
@@ -936,18 +3341,287 @@ bool store(const string &path, const_stream s, directoryType type, bool compress
         }
     }
 
-    size_t bytesWrite = std::fwrite(s.data(), s.size(), 1, f);
-    if (s.size() != 0 && bytesWrite != 1) {
+    bool written = io_engine::local().write(_fd(f), s.data(), s.size(), 0);
+    if (!written) {
         const char *e = strerror(errno);
         gassertl(false, strs("write file failed: ", path, " errno: ", e));
     }
 
     std::fclose(f);
-    return bytesWrite == 1;
+    return written;
+}
+
+// streaming writer state, regular files are written to temporary file renamed on commit,
+// archive files are kept in memory while small (stored as any file), bigger ones are staged
+// in temporary file next to archive as lz4 frame blocks and appended to archive on commit
+struct fileWriter::state {
+    string path; // target file or archive
+    string id; // archive file id, empty for regular files
+    string temp; // temporary file, removed if not committed
+    std::FILE *f = nullptr; // temporary file
+    bool compress = false;
+    int level = 0;
+    uint64 size = 0; // bytes written
+    stream pending; // archive data not staged yet
+    std::vector<uint64> blocks; // offsets of staged blocks (from staging file start)
+    std::vector<uint32> blockCrcs; // crc32c of staged compressed blocks
+    uint64 staged = 0; // staging file size
+    stream block; // compressed block
+    bool failed = false;
+    bool done = false;
+    std::mutex mtx;
+
+    ~state() {
+        release();
+    }
+
+    // closes and removes temporary file
+    void release() {
+        if (f != nullptr)
+            std::fclose(f);
+        if (!temp.empty())
+            std::remove(temp.c_str());
+        f = nullptr;
+        temp.clear();
+    }
+
+    bool open(const string &tempPath) {
+        f = std::fopen(tempPath.c_str(), "wb+");
+        if (f == NULL)
+            return false;
+        temp = tempPath;
+        return true;
+    }
+
+    // stages whole blocks of pending archive data (all pending data if last)
+    bool stage(bool last) {
+        if (f == nullptr && !open(_tempPath(path))) {
+            const char *e = strerror(errno);
+            logError(strs("file writer: could not create staging file for: ", id, " errno: ", e));
+            return false;
+        }
+
+        size_t consumed = 0;
+        while (pending.size() - consumed >= _frameBlockSize || (last && consumed < pending.size())) {
+            size_t chunk = std::min(_frameBlockSize, pending.size() - consumed);
+            const uint8 *data = pending.data() + consumed;
+            size_t n = chunk;
+            if (compress) {
+                if (!_compressBlock(data, chunk, level, block))
+                    return false;
+                data = block.data();
+                n = block.size();
+                blocks.push_back(staged);
+                blockCrcs.push_back(crc32c(block.data() + sizeof(uint32), block.size() - sizeof(uint32)));
+            }
+            if (1 != std::fwrite(data, n, 1, f))
+                return false;
+            staged += n;
+            consumed += chunk;
+        }
+        size_t left = pending.size() - consumed;
+        memmove(pending.data(), pending.data() + consumed, left);
+        pending.resize(left);
+        return true;
+    }
+
+    // appends staged file to archive (appendLock held), vfs is locked only to replace file in index
+    bool append(vfs &v) {
+        uint64 offset = v.indexOffset, position = offset;
+        uint32 crc = 0;
+        bool written = true;
+        auto write = [&v, &offset, &crc, &written](const void *data, size_t bytes) {
+            written = written && (bytes == 0 || 1 == std::fwrite(data, bytes, 1, v.f));
+            crc = crc32c(data, bytes, crc);
+            offset += bytes;
+        };
+        std::fseek(v.f, (long)offset, SEEK_SET);
+
+        // frame header
+        uint64 header = 0;
+        if (compress) {
+            int64 realSize = size;
+            uint32 blockSize = (uint32)_frameBlockSize;
+            write(&realSize, sizeof(int64));
+            write(&blockSize, sizeof(uint32));
+            header = sizeof(int64) + sizeof(uint32);
+        }
+
+        // staged data
+        std::fflush(f);
+        stream &buffer = _readBuffer;
+        buffer.resize(_frameBlockSize);
+        for (uint64 read = 0; read < staged && written; ) {
+            size_t n = (size_t)std::min<uint64>(buffer.size(), staged - read);
+            if (!_pread(f, buffer.data(), n, read)) {
+                written = false;
+                break;
+            }
+            write(buffer.data(), n);
+            read += n;
+        }
+
+        // frame end and block table
+        uint8 flags = vfs_checksum;
+        if (compress) {
+            for (auto &b : blocks)
+                b += header;
+            uint32 endMark = 0;
+            uint32 blocksCount = (uint32)blocks.size() | _blockCrcs;
+            write(&endMark, sizeof(uint32));
+            write(blockCrcs.data(), blockCrcs.size() * sizeof(uint32));
+            write(blocks.data(), blocks.size() * sizeof(uint64));
+            write(&blocksCount, sizeof(uint32));
+            flags |= vfs_compressed | vfs_frame | vfs_independent | vfs_block_table | (level > 0 ? vfs_hc : 0);
+        }
+        written = written && 0 == std::fflush(v.f);
+        if (!written) {
+            // replaced file stays, index ends before written data
+            const char *e = strerror(errno);
+            gassertl(false, strs("error: could not write file: ", id, " to vfs, errno: ", e));
+            return false;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(v.lock);
+        _vfs_materialize(v);
+        _vfs_replace(v, {id, position, offset - position, flags, (uint64)std::time(0), (uint64)std::time(0), crc, digest128()});
+        v.indexOffset = offset;
+        return _vfs_journal_commit(v);
+    }
+};
+
+fileWriter::fileWriter(std::shared_ptr<state> s) : _s(s) {}
+
+bool fileWriter::valid() const {
+    return _s && !_s->done;
+}
+
+uint64 fileWriter::size() const {
+    return _s ? _s->size : 0;
+}
+
+bool fileWriter::write(const void *data, size_t size) {
+    if (!valid())
+        return false;
+    std::lock_guard<std::mutex> lock(_s->mtx);
+    if (_s->failed)
+        return false;
+    _s->size += size;
+
+    if (_s->id.empty()) {
+        _s->failed = size > 0 && 1 != std::fwrite(data, size, 1, _s->f);
+        return !_s->failed;
+    }
+
+    // small archive files are stored from memory, bigger are staged block by block
+    stream &p = _s->pending;
+    size_t offset = p.size();
+    p.resize(offset + size);
+    memcpy(p.data() + offset, data, size);
+    if (_s->f != nullptr || p.size() >= _frameThreshold)
+        _s->failed = !_s->stage(false);
+    return !_s->failed;
+}
+
+bool fileWriter::flush() {
+    if (!valid())
+        return false;
+    std::lock_guard<std::mutex> lock(_s->mtx);
+    return !_s->failed && (_s->f == nullptr || 0 == std::fflush(_s->f));
+}
+
+bool fileWriter::commit() {
+    if (!valid())
+        return false;
+    std::lock_guard<std::mutex> lock(_s->mtx);
+    _s->done = true;
+    if (_s->failed) {
+        gassertl(false, strs("file writer: write failed, not committed: ", _s->path, _s->id));
+        return false;
+    }
+
+    // regular file is replaced atomically
+    if (_s->id.empty()) {
+        bool synced = 0 == std::fflush(_s->f);
+        #ifdef GE_PLATFORM_WINDOWS
+        synced = synced && 0 == _commit(_fd(_s->f));
+        #else
+        synced = synced && 0 == fsync(_fd(_s->f));
+        #endif
+        std::fclose(_s->f);
+        _s->f = nullptr;
+        #ifdef GE_PLATFORM_WINDOWS
+        bool renamed = synced && MoveFileExA(_s->temp.c_str(), _s->path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+        #else
+        bool renamed = synced && 0 == std::rename(_s->temp.c_str(), _s->path.c_str());
+        #endif
+        if (!renamed) {
+            const char *e = strerror(errno);
+            gassertl(false, strs("file writer: could not replace file: ", _s->path, " errno: ", e));
+            return false;
+        }
+        _s->temp.clear();
+        return true;
+    }
+
+    if (_s->f != nullptr && !_s->stage(true))
+        return false;
+
+    std::shared_lock<std::shared_mutex> vfsLock(_vfsLock);
+    auto v = _vfs.find(_s->path);
+    if (v == _vfs.end()) {
+        gassertl(false, strs("could not write: ", _s->id, " to vfs: ", _s->path, ", archive closed"));
+        return false;
+    }
+    std::lock_guard<std::mutex> alock(v->second.appendLock);
+    if (_s->f == nullptr)
+        return _vfs_add(v->second, _s->id, _s->pending, _s->compress);
+    bool r = _s->append(v->second);
+    _s->release();
+    return r;
+}
+
+// open streaming writer for file/archive file
+fileWriter create(const string &path, directoryType type, bool compress) {
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
+    bool vfs, valid;
+    string filepath, id;
+    std::tie(filepath, id, vfs, valid) = _resolveLocation(path, type, false);
+
+    auto s = std::make_shared<fileWriter::state>();
+    if (vfs) {
+        if (_vfs.find(filepath) == _vfs.end()) {
+            gassertl(false, strs("could not write: ", path, " to vfs, probably archive not initialized"));
+            return fileWriter();
+        }
+        s->path = filepath;
+        s->id = id;
+        s->compress = compress && _compressible(id);
+        s->level = _compressionProfile(id).level;
+        return fileWriter(s);
+    }
+
+    // temporary file in target directory (rename does not cross file systems)
+    s->path = filepath;
+    string temp = _tempPath(filepath);
+    if (!s->open(temp)) {
+        #ifdef GE_PLATFORM_WINDOWS
+        _mkdirtree(getPath(type), extractFilePath(_normalizePath(path)));
+        #else
+        _mkdirtree(getPath(type), extractFilePath(path));
+        #endif
+        if (!s->open(temp)) {
+            const char *e = strerror(errno);
+            gassertl(false, strs("could not open file: ", temp, " errno:", e));
+            return fileWriter();
+        }
+    }
+    return fileWriter(s);
 }
 
 // remove file / archive file
 bool remove(const string &path, directoryType type) {
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
     bool vfs, valid;
     string filepath, id;
     std::tie(filepath, id, vfs, valid) = _resolveLocation(path, type, true);
@@ -960,8 +3634,10 @@ bool remove(const string &path, directoryType type) {
     if (vfs) {
         auto v = _vfs.find(filepath);
         gassert(v != _vfs.end(), strs("vfs index not found: ", path));
-        if (v != _vfs.end())
+        if (v != _vfs.end()) {
+            std::unique_lock<std::shared_mutex> vlock(v->second.lock);
             return _vfs_remove(v->second, id);
+        }
         return false;
     }
 
@@ -971,15 +3647,20 @@ bool remove(const string &path, directoryType type) {
         gassertl(false, strs("error deleting file: ", filepath, " errno: ", e));
     }
 
-    // remove archive index also
+    // remove archive index (and journal) also
+    lock.unlock();
+    std::unique_lock<std::shared_mutex> wlock(_vfsLock);
     auto v = _vfs.find(filepath);
-    if (v != _vfs.end())
+    if (v != _vfs.end()) {
+        _vfs_journal_reset(v->second);
         _vfs.erase(v);
+    }
     return err == 0;
 }
 
 // checks if archive file/file exists
 bool exists(const string &name, directoryType type) {
+    std::shared_lock<std::shared_mutex> lock(_vfsLock);
     bool vfs, valid;
     string filepath, id;
     std::tie(filepath, id, vfs, valid) = _resolveLocation(name, type, true);
@@ -990,8 +3671,10 @@ bool exists(const string &name, directoryType type) {
     if (vfs) {
         auto v = _vfs.find(filepath);
         gassert(v != _vfs.end(), strs("vfs index not found: ", name));
-        if (v != _vfs.end())
+        if (v != _vfs.end()) {
+            std::shared_lock<std::shared_mutex> vlock(v->second.lock);
             return _vfs_exists(v->second, id);
+        }
         return false;
     }
 
@@ -1003,6 +3686,92 @@ namespace detail {
 struct watchData;
 std::map<uint32, watchData> watches;
 uint32 watchesId = 1;
+
+// changes of one watch waiting until their path is quiet for coalesce window
+struct pendingChanges {
+    struct change {
+        string path;
+        fileMonitorChange change;
+        bool cancelled; // added and removed within window
+        std::chrono::steady_clock::time_point last;
+    };
+    std::vector<change> changes; // first seen order
+    std::unordered_map<string, size_t> index;
+};
+
+std::atomic<uint32> coalesceWindow(0);
+std::mutex pendingLock;
+std::map<uint32, pendingChanges> pending;
+
+// merges changes of the same path, releases paths without changes for coalesce window,
+// must be called on every poll (also without new changes)
+fileMonitorChanges coalesce(uint32 id, fileMonitorChanges &&changes) {
+    uint32 window = coalesceWindow;
+    std::lock_guard<std::mutex> lock(pendingLock);
+    auto p = pending.find(id);
+    if (window == 0 && p == pending.end())
+        return std::move(changes);
+
+    // changes were lost, pending changes are meaningless (consumer rescans)
+    for (const auto &c : changes) {
+        if (std::get<0>(c) == fileMonitorOverflow) {
+            pending.erase(id);
+            return { c };
+        }
+    }
+
+    pendingChanges &pc = pending[id];
+    auto now = std::chrono::steady_clock::now();
+    for (auto &c : changes) {
+        fileMonitorChange change = std::get<0>(c);
+        auto i = pc.index.find(std::get<1>(c));
+        if (i == pc.index.end()) {
+            pc.index[std::get<1>(c)] = pc.changes.size();
+            pc.changes.push_back({std::move(std::get<1>(c)), change, false, now});
+            continue;
+        }
+
+        auto &e = pc.changes[i->second];
+        e.last = now;
+        if (e.cancelled) {
+            e.cancelled = false;
+            e.change = change;
+        }
+        else if (e.change == fileMonitorAdd && change == fileMonitorRemove)
+            e.cancelled = true;
+        else if (e.change == fileMonitorRemove && change == fileMonitorAdd)
+            e.change = fileMonitorModify; // replaced
+        else if (e.change != fileMonitorAdd)
+            e.change = change; // added and modified is still add
+    }
+
+    // release quiet paths
+    fileMonitorChanges r;
+    std::vector<pendingChanges::change> waiting;
+    for (auto &e : pc.changes) {
+        if (now - e.last >= std::chrono::milliseconds(window)) {
+            if (!e.cancelled)
+                r.push_back(std::make_tuple(e.change, std::move(e.path)));
+        }
+        else waiting.push_back(std::move(e));
+    }
+    pc.changes = std::move(waiting);
+    pc.index.clear();
+    for (size_t i = 0; i < pc.changes.size(); ++i)
+        pc.index[pc.changes[i].path] = i;
+    if (pc.changes.empty())
+        pending.erase(id);
+    return r;
+}
+
+void releasePending(uint32 id) {
+    std::lock_guard<std::mutex> lock(pendingLock);
+    pending.erase(id);
+}
+}
+
+void coalesceWatchEvents(uint32 milliseconds) {
+    detail::coalesceWindow = milliseconds;
 }
 
 #if defined(GE_PLATFORM_WINDOWS)
@@ -1151,81 +3920,280 @@ void removeWatch(uint32 id) {
     // delete from index
     delete wd.watchThread;
     detail::watches.erase(e);
+    detail::releasePending(id);
     logInfo(strs("file watch released: ", id));
 }
 
+fileMonitorChanges pollWatch(uint32 id) {
+    auto e = detail::watches.find(id);
+    if (e == detail::watches.end())
+        return fileMonitorChanges();
+
+    detail::watchData &wd = e->second;
+    if (wd.watchAvailable) {
+        // take results (swap with empty vector)
+        fileMonitorChanges ret;
+        std::swap(ret, wd.changes);
+
+        // we have result -> notify watcher thread
+        std::unique_lock<std::mutex> lock(wd.mtx);
+        wd.watchAvailable = false;
+        wd.cv.notify_one();
+
+        // return results copy
+        return detail::coalesce(id, std::move(ret));
+    }
+    return detail::coalesce(id, fileMonitorChanges());
+}
+
+
 #elif defined(GE_PLATFORM_LINUX)
 
 #define EVENT_SIZE (sizeof(struct inotify_event))
 #define EVENT_BUF_LEN (1024 * (EVENT_SIZE + NAME_MAX + 1))
 #define WATCH_FLAGS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_TO | IN_MOVED_FROM)
+#define WATCH_SUBDIR_FLAGS (WATCH_FLAGS | IN_ONLYDIR | IN_DONT_FOLLOW) // links are not followed (no cycles)
 
 namespace detail {
+typedef queue_mpmc<std::tuple<fileMonitorChange, string>> changeQueue;
+const size_t changeQueueSize = 1024;
+
+// changes written by watcher thread, drained by pollWatch (neither waits for the other)
+struct changeBuffer {
+    changeQueue changes;
+    std::atomic<bool> overflow; // changes were lost (consumer should rescan)
+
+    changeBuffer() : changes(changeQueueSize), overflow(false) {}
+};
+
 struct watchData {
-    std::thread *watchThread = nullptr;
+    string path; // watched directory (with separator)
+    bool recursive;
+    std::unordered_map<int, string> dirs; // inotify watch (shared by watches of the same directory) -> directory relative to path
+    std::shared_ptr<changeBuffer> buffer;
+};
+
+// one inotify instance and one thread for all watches, thread waits on epoll,
+// eventfd breaks the wait on shutdown
+struct watcher {
+    std::mutex mtx; // guards watches, targets and watched dirs (held only for lookups, pollWatch is not blocked by scans)
+    std::mutex scanMtx; // serializes inotify watch changes and directory scans (taken before mtx)
+    std::thread *thread = nullptr;
+    int epoll = -1;
+    int wake = -1;
+    int inotify = -1;
+    std::unordered_map<int, std::vector<uint32>> targets; // inotify watch -> watch ids
     char buffer[EVENT_BUF_LEN];
-    fd_set watchSet;
-    int fd;
-    int wd;
 
-    // TODO: bool recursive;
+    ~watcher() {
+        if (thread) {
+            uint64 one = 1;
+            if (write(wake, &one, sizeof(one)) == sizeof(one))
+                thread->join();
+            else thread->detach();
+            delete thread;
+            ::close(inotify);
+            ::close(epoll);
+            ::close(wake);
+        }
+    }
 
-    bool watchAvailable;
-    bool running;
-    std::mutex mtx;
-    std::condition_variable cv;
-    fileMonitorChanges changes;
-};
+    // starts thread on first watch, call with mtx locked
+    bool start() {
+        if (thread)
+            return true;
+        epoll = epoll_create1(EPOLL_CLOEXEC);
+        wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        bool registered = epoll >= 0 && wake >= 0 && inotify >= 0;
+        ev.data.fd = wake;
+        registered = registered && epoll_ctl(epoll, EPOLL_CTL_ADD, wake, &ev) == 0;
+        ev.data.fd = inotify;
+        registered = registered && epoll_ctl(epoll, EPOLL_CTL_ADD, inotify, &ev) == 0;
+        if (!registered) {
+            const char *e = strerror(errno);
+            logError(strs("directory watch: could not initialize inotify/epoll, errno: ", e));
+            for (int fd : {epoll, wake, inotify}) {
+                if (fd >= 0)
+                    ::close(fd);
+            }
+            epoll = wake = inotify = -1;
+            return false;
+        }
+        thread = new std::thread([this]() { run(); });
+        return true;
+    }
 
-void watchThread(watchData &wd) {
-    while (wd.running) {
-        // wait for events here
-        // i have added 0.5s limit for select because closing file
-        // descriptor in another thread (close) causes undefined behaviour
-        // on some linux systems, as a result application will lock forever
-        // on select (see: man select). There is no other way to break select
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 500000;
-        select(wd.fd + 1, &wd.watchSet, NULL, NULL, &tv);
+    void push(watchData &w, fileMonitorChange c, const string &path) {
+        if (!w.buffer->changes.push_ts(std::make_tuple(c, path)))
+            lost(w);
+    }
 
-        // wait for condition variable
-        // hangs up reading until someone reads and discards result
+    // change is dropped, reported as overflow on next poll
+    void lost(watchData &w) {
+        if (!w.buffer->overflow.exchange(true))
+            logError(strs("directory watch: changes lost (not polled in time): ", w.path));
+    }
+
+    // watches directory (relative to watch path) and its subdirectories if watch is recursive,
+    // contents of directories created after watch started are reported as added,
+    // call with scanMtx locked (mtx is taken only to register watch)
+    int add(watchData &w, uint32 id, const string &dir, bool report) {
+        int wd = inotify_add_watch(inotify, (w.path + dir).c_str(), dir.empty() ? WATCH_FLAGS : WATCH_SUBDIR_FLAGS);
+        if (wd < 0 && !dir.empty() && errno != ENOENT && errno != ENOTDIR) {
+            // changes in subdirectory will not be reported (watch limit reached), client should rescan
+            const char *e = strerror(errno);
+            logError(strs("inotify_add_watch failed, errno: ", e, " dir: ", w.path + dir));
+            w.buffer->overflow = true;
+        }
+        if (wd < 0)
+            return wd;
         {
-            std::unique_lock<std::mutex> lock(wd.mtx);
-            while (wd.watchAvailable)
-                wd.cv.wait(lock);
+            std::lock_guard<std::mutex> lock(mtx);
+            if (w.dirs.count(wd) > 0)
+                return wd;
+            targets[wd].push_back(id);
+            w.dirs[wd] = dir;
         }
 
-        // we have events, lets read them
-        int len = read(wd.fd, wd.buffer, EVENT_BUF_LEN);
+        if (w.recursive) {
+            for (const auto &fi : _filterFileList(w.path, dir, std::function<bool(fileInfo &)>(), false)) {
+                string path = dir.empty() ? fi.name : dir + "/" + fi.name;
+                if (report)
+                    push(w, fileMonitorAdd, path);
+                if (fi.dir)
+                    add(w, id, path, report);
+            }
+        }
+        return wd;
+    }
 
-        if (len > 0) {
-            bool dataAdded = false;
-            for (int i = 0; i < len; ) {
-                struct inotify_event *e = (struct inotify_event*)&wd.buffer[i];
-                if (e->wd != -1 && (e->mask & IN_Q_OVERFLOW) == 0) {
-                    if ((e->mask & IN_CREATE) ||
-                        (e->mask & IN_MOVED_TO)) {
-                        wd.changes.push_back(std::make_tuple(fileMonitorAdd, string(e->name)));
-                        dataAdded = true;
-                    }
-                    else if ((e->mask & IN_DELETE) ||
-                             (e->mask & IN_MOVED_FROM)) {
-                        wd.changes.push_back(std::make_tuple(fileMonitorRemove, string(e->name)));
-                        dataAdded = true;
-                    }
-                    else if (e->mask & IN_MODIFY) {
-                        wd.changes.push_back(std::make_tuple(fileMonitorModify, string(e->name)));
-                        dataAdded = true;
-                    }
+    // stops watching directory and its subdirectories, call with scanMtx and mtx locked
+    void remove(watchData &w, uint32 id, const string &dir) {
+        for (auto d = w.dirs.begin(); d != w.dirs.end(); ) {
+            if (d->second == dir || (d->second.size() > dir.size() && d->second[dir.size()] == '/' && !d->second.compare(0, dir.size(), dir))) {
+                release(d->first, id);
+                d = w.dirs.erase(d);
+            }
+            else ++d;
+        }
+    }
+
+    // inotify watch is removed with its last user, call with scanMtx and mtx locked
+    void release(int wd, uint32 id) {
+        auto t = targets.find(wd);
+        if (t == targets.end())
+            return;
+        t->second.erase(std::remove(t->second.begin(), t->second.end(), id), t->second.end());
+        if (t->second.empty()) {
+            inotify_rm_watch(inotify, wd);
+            targets.erase(t);
+        }
+    }
+
+    // reads all pending events, directories created or removed in recursive watches are
+    // (un)watched after each batch of events without holding mtx
+    void read() {
+        std::vector<std::tuple<uint32, string, bool>> subdirs; // watch id, directory, added
+        ssize_t len;
+        while ((len = ::read(inotify, buffer, EVENT_BUF_LEN)) > 0) {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                dispatch(len, subdirs);
+            }
+
+            std::lock_guard<std::mutex> lock(scanMtx);
+            for (const auto &d : subdirs) {
+                auto w = watches.find(std::get<0>(d));
+                if (w == watches.end())
+                    continue; // watch removed (watches are erased with scanMtx locked)
+                if (std::get<2>(d))
+                    add(w->second, w->first, std::get<1>(d), true);
+                else {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    remove(w->second, w->first, std::get<1>(d));
                 }
-                i += EVENT_SIZE + e->len;
             }
-            wd.watchAvailable = dataAdded;
+            subdirs.clear();
         }
     }
-}
+
+    // reports read events to watches, call with mtx locked
+    void dispatch(ssize_t len, std::vector<std::tuple<uint32, string, bool>> &subdirs) {
+        for (ssize_t i = 0; i < len; ) {
+            struct inotify_event *e = (struct inotify_event*)&buffer[i];
+            i += EVENT_SIZE + e->len;
+            if (e->mask & IN_Q_OVERFLOW) {
+                // kernel queue overflow, unknown which watches lost events
+                for (auto &w : watches)
+                    lost(w.second);
+                continue;
+            }
+            if (e->wd == -1)
+                continue;
+            auto t = targets.find(e->wd);
+            if (t == targets.end())
+                continue; // watch already removed
+            std::vector<uint32> ids = t->second;
+            if (e->mask & IN_IGNORED) {
+                // directory removed
+                targets.erase(t);
+                for (uint32 id : ids) {
+                    auto w = watches.find(id);
+                    if (w != watches.end())
+                        w->second.dirs.erase(e->wd);
+                }
+                continue;
+            }
+            if (e->len == 0)
+                continue;
+
+            fileMonitorChange c;
+            if (e->mask & (IN_CREATE | IN_MOVED_TO))
+                c = fileMonitorAdd;
+            else if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+                c = fileMonitorRemove;
+            else if (e->mask & IN_MODIFY)
+                c = fileMonitorModify;
+            else continue;
+
+            for (uint32 id : ids) {
+                auto w = watches.find(id);
+                if (w == watches.end())
+                    continue;
+                auto d = w->second.dirs.find(e->wd);
+                if (d == w->second.dirs.end())
+                    continue;
+
+                string path = d->second.empty() ? string(e->name) : d->second + "/" + e->name;
+                push(w->second, c, path);
+                if (w->second.recursive && (e->mask & IN_ISDIR) != 0 && c != fileMonitorModify)
+                    subdirs.push_back(std::make_tuple(id, path, c == fileMonitorAdd));
+            }
+        }
+    }
+
+    void run() {
+        epoll_event events[2];
+        while (true) {
+            int count = epoll_wait(epoll, events, 2, -1);
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                const char *e = strerror(errno);
+                logError(strs("directory watch: epoll_wait failed, errno: ", e));
+                return;
+            }
+            for (int i = 0; i < count; ++i) {
+                if (events[i].data.fd == wake)
+                    return; // shutdown
+                read();
+            }
+        }
+    }
+} watcherState;
 } // ~detail
 
 uint32 addWatch(const string &dir, bool recursively, directoryType type) {
@@ -1240,89 +4208,67 @@ uint32 addWatch(const string &dir, bool recursively, directoryType type) {
         return 0;
     }
 
-    gassert(detail::watches.find(detail::watchesId) == detail::watches.end(), "too many watches created");
-    detail::watchData &wd = detail::watches[detail::watchesId];
-
-    wd.fd = inotify_init1(IN_NONBLOCK);
-    if (wd.fd < 0) {
-        const char *e = strerror(errno);
-        logError(strs("inotify_init1 < 0, errno: ", e));
-        return 0;
+    // add watch to given directory (and subdirectories), subdirectories are scanned without blocking polls
+    std::lock_guard<std::mutex> scanLock(detail::watcherState.scanMtx);
+    detail::watchData *w;
+    {
+        std::lock_guard<std::mutex> lock(detail::watcherState.mtx);
+        if (!detail::watcherState.start())
+            return 0;
+        gassert(detail::watches.find(detail::watchesId) == detail::watches.end(), "too many watches created");
+        w = &detail::watches[detail::watchesId];
+        w->path = path.back() == '/' ? path : path + "/";
+        w->recursive = recursively;
+        w->buffer = std::make_shared<detail::changeBuffer>();
     }
-
-    // use select watch list for non-blocking inotify read
-    FD_ZERO(&wd.watchSet);
-    FD_SET(wd.fd, &wd.watchSet);
-
-    // add watch to given directory
-    wd.wd = inotify_add_watch(wd.fd, path.c_str(), WATCH_FLAGS);
-    if (wd.wd < 0) {
+    if (detail::watcherState.add(*w, detail::watchesId, "", false) < 0) {
         const char *e = strerror(errno);
         logError(strs("inotify_add_watch failed, errno: ", e, " dir: ", path));
+        std::lock_guard<std::mutex> lock(detail::watcherState.mtx);
+        detail::watches.erase(detail::watchesId);
         return 0;
     }
-
-    // fire thread loop
-    wd.running = true;
-    wd.watchThread = new std::thread(detail::watchThread, std::ref(wd));
-    logInfo(strs("created directory watch for: ", path, " id: ", wd.fd));
+    logInfo(strs("created directory watch for: ", path, " id: ", detail::watchesId));
     return detail::watchesId++;
 }
 
 void removeWatch(uint32 id) {
+    std::lock_guard<std::mutex> scanLock(detail::watcherState.scanMtx);
+    std::lock_guard<std::mutex> lock(detail::watcherState.mtx);
     auto e = detail::watches.find(id);
     gassert(e != detail::watches.end(), strs("trying to remove non existing watch: ", id));
     if (e == detail::watches.end())
         return;
 
     logInfo(strs("releasing file watch: ", id));
+    for (const auto &d : e->second.dirs)
+        detail::watcherState.release(d.first, id);
+    detail::watches.erase(e);
+    detail::releasePending(id);
+    logInfo(strs("file watch released: ", id));
+}
 
-    detail::watchData &wd = e->second;
-    // break watch thread
+fileMonitorChanges pollWatch(uint32 id) {
+    std::shared_ptr<detail::changeBuffer> buffer;
     {
-        std::unique_lock<std::mutex> lock(wd.mtx);
-        wd.running = false;
-        wd.watchAvailable = false;
-        wd.cv.notify_one();
+        std::lock_guard<std::mutex> lock(detail::watcherState.mtx);
+        auto e = detail::watches.find(id);
+        if (e == detail::watches.end())
+            return fileMonitorChanges();
+        buffer = e->second.buffer;
     }
 
-    // close all watch handles
-    ::close(wd.fd);
-    fflush(stdout);
-    inotify_rm_watch(wd.fd, wd.wd);
-
-    // joint thread
-    wd.watchThread->join();
-
-    // delete from index
-    delete wd.watchThread;
-    detail::watches.erase(e);
-    logInfo(strs("file watch released: ", id));
+    // take batch without blocking watcher thread
+    fileMonitorChanges ret;
+    std::tuple<fileMonitorChange, string> c;
+    while (buffer->changes.pop_ts(c))
+        ret.push_back(std::move(c));
+    if (buffer->overflow.exchange(false))
+        ret.push_back(std::make_tuple(fileMonitorOverflow, string()));
+    return detail::coalesce(id, std::move(ret));
 }
 #else
 #error "platform not supported"
 #endif
 
-fileMonitorChanges pollWatch(uint32 id) {
-    auto e = detail::watches.find(id);
-    if (e == detail::watches.end())
-        return fileMonitorChanges();
-
-    detail::watchData &wd = e->second;
-    if (wd.watchAvailable) {
-        // take results (swap with empty vector)
-        fileMonitorChanges ret;
-        std::swap(ret, wd.changes);
-
-        // we have result -> notify watcher thread
-        std::unique_lock<std::mutex> lock(wd.mtx);
-        wd.watchAvailable = false;
-        wd.cv.notify_one();
-
-        // return results copy
-        return ret;
-    }
-    return fileMonitorChanges();
-}
-
 }}}
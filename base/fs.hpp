@@ -13,6 +13,7 @@
 #pragma once
 #include "includes.hpp"
 #include "stream.hpp"
+#include <future>
 
 namespace granite { namespace base {
 
@@ -35,6 +36,55 @@ struct fileInfo {
 
 typedef std::vector<fileInfo> fileList;
 
+struct archiveCacheStats {
+    uint64 hits, misses;
+    size_t size, files, capacity;
+};
+typedef std::function<void(const string &path, stream &s)> loadCallback; //!< called on loader thread, must not call close() (it waits for loader threads)
+
+// seekable read only file handle (copies share state), compressed archive files with block table
+// are decompressed only in blocks touched by read, other compressed files are decompressed on open,
+// archive files are verified (verifyChecksums) by block checksums when blocks are read, small files without
+// them on open (reader is invalid if data is corrupted), bigger uncompressed files only by load
+class fileReader {
+public:
+    struct state;
+
+private:
+    std::shared_ptr<state> _s;
+
+public:
+    fileReader() = default;
+    fileReader(std::shared_ptr<state> s);
+
+    bool valid() const;
+    uint64 size() const; //!< uncompressed size
+    size_t read(uint64 offset, void *data, size_t size); //!< returns bytes read (less at the end of file or on error)
+    stream read(uint64 offset, size_t size);
+};
+
+// streaming write handle (copies share state), data goes to temporary file and replaces target
+// on commit (atomic rename), archive files are compressed block by block and added on commit,
+// writer destroyed without commit discards written data
+class fileWriter {
+public:
+    struct state;
+
+private:
+    std::shared_ptr<state> _s;
+
+public:
+    fileWriter() = default;
+    fileWriter(std::shared_ptr<state> s);
+
+    bool valid() const; //!< false if not opened or already committed
+    uint64 size() const; //!< bytes written
+    bool write(const void *data, size_t size);
+    bool write(const const_stream &s) { return write(s.data(), s.size()); }
+    bool flush(); //!< pushes buffered data to temporary file
+    bool commit(); //!< makes file visible (replaces old one), returns false if any write failed
+};
+
 string getExecutableDirectory();
 string getUserDirectory();
 
@@ -42,18 +92,37 @@ bool open(const string &path, directoryType type = workingDirectory);
 void createFolderTree(const string &path);
 void preferArchives(bool doPrefer);
 void doNotCompress(std::vector<string> extensions);
+void compressionProfile(const string &extension, int level, bool useDictionary = false); //!< level 0 - lz4 fast, 1-12 - lz4 hc, "" extension sets default
+bool trainArchiveDictionary(const string &archive, const std::vector<string> &samples, directoryType type = workingDirectory); //!< builds shared dictionary from sample files, files compressed with previous one are recompressed
 void allowGlobalPaths(bool doAllow);
+void memoryMapThreshold(size_t bytes); //!< regular files this big (or bigger) are loaded as memory mapped streams, 0 disables mapping
+void verifyChecksums(bool doVerify); //!< verify crc32c of archive files on load (enabled by default)
+void journalArchives(bool doJournal); //!< changes of archives opened after call are recorded in journal (<archive>.journal) and survive crash (synced to device in batches, at most 50ms after store/remove), index is written on flush/close only (disabled by default)
+void deduplicateArchives(bool doDeduplicate); //!< files stored to archives are hashed, files with same content share data (disabled by default)
+void memoryMapArchives(bool doMap); //!< read archives through memory mapping, uncompressed archive files are loaded as read only views (no copy)
+void compactionBudget(size_t bytesPerSecond); //!< io limit of background archive compaction (32MB/s by default), 0 disables background compaction
+void archiveCacheSize(size_t bytes); //!< size of decompressed archive files cache (64MB by default), 0 disables cache
+archiveCacheStats getArchiveCacheStats();
 void initArchive(const string &path, directoryType type = workingDirectory);
 void initAllArchives(directoryType type = workingDirectory);
 void flush();
 bool createArchive(const string &path, directoryType = workingDirectory);
+void compactArchive(const string &path, directoryType type = workingDirectory); //!< reclaims holes left by removed files, blocks until done
+bool packDirectory(const string &dir, const string &archive, directoryType type = workingDirectory, bool compress = true); //!< adds all files from directory (recursively) to archive, reads and compresses in parallel, false if any file could not be read or stored
 void close();
 fileList listFiles(const string &path = "", directoryType type = workingDirectory);
 fileList listFilesFlat(const string &path = "", directoryType type = workingDirectory);
 fileList findFiles(const string &name, const string &path = "", directoryType type = workingDirectory);
 fileList matchFiles(const string &regex, const string &path = "", directoryType type = workingDirectory);
+fileList globFiles(const string &glob, const string &path = "", directoryType type = workingDirectory); //!< * ? [...] {a,b} patterns, * and ? do not match /
 stream load(const string &path, directoryType type = workingDirectory);
+fileReader openFile(const string &path, directoryType type = workingDirectory); //!< invalid reader if file does not exist
+std::future<stream> loadAsync(const string &path, directoryType type = workingDirectory);
+void loadAsync(const string &path, loadCallback callback, directoryType type = workingDirectory);
+std::vector<stream> loadBatch(const std::vector<string> &paths, directoryType type = workingDirectory); //!< parallel load in archive/disk order, blocks until all are loaded
+void loadBatch(const std::vector<string> &paths, loadCallback callback, directoryType type = workingDirectory); //!< returns immediately
 bool store(const string &path, const_stream s, directoryType type = workingDirectory, bool compress = true);
+fileWriter create(const string &path, directoryType type = workingDirectory, bool compress = true); //!< streaming store, memory use is bounded
 bool remove(const string &path, directoryType type = workingDirectory);
 bool exists(const string &name, directoryType type = workingDirectory);
 
@@ -61,14 +130,16 @@ bool exists(const string &name, directoryType type = workingDirectory);
 enum fileMonitorChange {
     fileMonitorAdd,
     fileMonitorRemove,
-    fileMonitorModify
+    fileMonitorModify,
+    fileMonitorOverflow //!< changes were lost (watch not polled in time or subdirectory could not be watched), path is empty, directory should be rescanned
 };
 
 typedef std::vector<std::tuple<fileMonitorChange, string>> fileMonitorChanges;
 
-uint32 addWatch(const string &dir, bool recursively = false, directoryType type = workingDirectory);
+uint32 addWatch(const string &dir, bool recursively = false, directoryType type = workingDirectory); //!< recursive watch reports paths relative to dir
 fileMonitorChanges pollWatch(uint32 id);
 void removeWatch(uint32 id);
+void coalesceWatchEvents(uint32 milliseconds); //!< changes of a path are merged and reported once the path is quiet for given time (0 - disabled, default)
 
 }
 
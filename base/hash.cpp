@@ -0,0 +1,186 @@
+#include "hash.hpp"
+#include "hwinfo.hpp"
+#include <nmmintrin.h>
+
+namespace granite { namespace base {
+
+namespace {
+//- crc32c
+// slicing by 8 tables for software fallback
+struct crc32c_tables {
+    uint32 t[8][256];
+
+    crc32c_tables() {
+        for (uint32 i = 0; i < 256; ++i) {
+            uint32 c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c >> 1) ^ (0x82f63b78 & (0 - (c & 1)));
+            t[0][i] = c;
+        }
+        for (uint32 i = 0; i < 256; ++i)
+            for (int k = 1; k < 8; ++k)
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+    }
+};
+
+uint32 crc32c_sw(uint32 crc, const uint8 *p, size_t size) {
+    static const crc32c_tables tables;
+    const auto &t = tables.t;
+    while (size > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+        --size;
+    }
+    while (size >= 8) {
+        uint64 v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^ t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff] ^
+              t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^ t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(GE_COMPILER_GCC) || defined(GE_COMPILER_CLANG)
+__attribute__((target("sse4.2")))
+#endif
+uint32 crc32c_hw(uint32 crc, const uint8 *p, size_t size) {
+    while (size > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        --size;
+    }
+    #ifdef GE_ARCHITECTURE_64
+    uint64 c = crc;
+    while (size >= 32) {
+        c = _mm_crc32_u64(c, *(const uint64*)p);
+        c = _mm_crc32_u64(c, *(const uint64*)(p + 8));
+        c = _mm_crc32_u64(c, *(const uint64*)(p + 16));
+        c = _mm_crc32_u64(c, *(const uint64*)(p + 24));
+        p += 32;
+        size -= 32;
+    }
+    while (size >= 8) {
+        c = _mm_crc32_u64(c, *(const uint64*)p);
+        p += 8;
+        size -= 8;
+    }
+    crc = (uint32)c;
+    #endif
+    while (size >= 4) {
+        crc = _mm_crc32_u32(crc, *(const uint32*)p);
+        p += 4;
+        size -= 4;
+    }
+    while (size-- > 0)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+//- murmur3
+uint64 rotl64(uint64 x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// final avalanche
+uint64 fmix64(uint64 k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+}
+
+uint32 crc32c(const void *data, size_t size, uint32 crc) {
+    static const bool hw = cpu::supportSSE42();
+    return ~(hw ? crc32c_hw(~crc, (const uint8*)data, size) : crc32c_sw(~crc, (const uint8*)data, size));
+}
+
+uint64 hash64(const void *data, size_t size, uint64 seed) {
+    const uint64 m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    uint64 h = seed ^ (size * m);
+
+    const uint8 *p = (const uint8*)data;
+    const uint8 *end = p + (size & ~size_t(7));
+    for (; p != end; p += 8) {
+        uint64 k;
+        memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    switch (size & 7) {
+    case 7: h ^= uint64(p[6]) << 48; // fallthrough
+    case 6: h ^= uint64(p[5]) << 40; // fallthrough
+    case 5: h ^= uint64(p[4]) << 32; // fallthrough
+    case 4: h ^= uint64(p[3]) << 24; // fallthrough
+    case 3: h ^= uint64(p[2]) << 16; // fallthrough
+    case 2: h ^= uint64(p[1]) << 8; // fallthrough
+    case 1: h ^= uint64(p[0]);
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+digest128 hash128(const void *data, size_t size, uint64 seed) {
+    const uint64 c1 = 0x87c37b91114253d5ull;
+    const uint64 c2 = 0x4cf5ad432745937full;
+    uint64 h1 = seed, h2 = seed;
+
+    const uint8 *p = (const uint8*)data;
+    const uint8 *end = p + (size & ~size_t(15));
+    for (; p != end; p += 16) {
+        uint64 k1, k2;
+        memcpy(&k1, p, 8);
+        memcpy(&k2, p + 8, 8);
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    uint64 k1 = 0, k2 = 0;
+    switch (size & 15) {
+    case 15: k2 ^= uint64(p[14]) << 48; // fallthrough
+    case 14: k2 ^= uint64(p[13]) << 40; // fallthrough
+    case 13: k2 ^= uint64(p[12]) << 32; // fallthrough
+    case 12: k2 ^= uint64(p[11]) << 24; // fallthrough
+    case 11: k2 ^= uint64(p[10]) << 16; // fallthrough
+    case 10: k2 ^= uint64(p[9]) << 8; // fallthrough
+    case 9: k2 ^= uint64(p[8]);
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        // fallthrough
+    case 8: k1 ^= uint64(p[7]) << 56; // fallthrough
+    case 7: k1 ^= uint64(p[6]) << 48; // fallthrough
+    case 6: k1 ^= uint64(p[5]) << 40; // fallthrough
+    case 5: k1 ^= uint64(p[4]) << 32; // fallthrough
+    case 4: k1 ^= uint64(p[3]) << 24; // fallthrough
+    case 3: k1 ^= uint64(p[2]) << 16; // fallthrough
+    case 2: k1 ^= uint64(p[1]) << 8; // fallthrough
+    case 1: k1 ^= uint64(p[0]);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    return {h1, h2};
+}
+
+}}
@@ -0,0 +1,46 @@
+/*
+ * granite engine 1.0 | 2006-2026 | Jakub Duracz | jakubduracz@gmail.com | http://jakubduracz.com
+ * file: hash
+ * created: 19-10-2026
+ *
+ * description: checksums and hash functions
+ *
+ * changelog:
+ * - 19-10-2026: file created
+ */
+
+#pragma once
+#include "includes.hpp"
+#include "stream.hpp"
+
+namespace granite { namespace base {
+
+// CRC32C (Castagnoli), uses SSE4.2 crc32 instruction when available
+// pass previous result as crc to checksum data in parts
+uint32 crc32c(const void *data, size_t size, uint32 crc = 0);
+inline uint32 crc32c(const const_stream &s, uint32 crc = 0) { return crc32c(s.data(), s.size(), crc); }
+inline uint32 crc32c(const stream &s, uint32 crc = 0) { return crc32c(s.data(), s.size(), crc); }
+inline uint32 crc32c(const chunked_stream &s, uint32 crc = 0) {
+    for (const auto &c : s.gather())
+        crc = crc32c(c.data(), c.size(), crc);
+    return crc;
+}
+
+// fast 64 bit hash for lookups (MurmurHash64A), not for checksums
+uint64 hash64(const void *data, size_t size, uint64 seed = 0);
+inline uint64 hash64(const string &s, uint64 seed = 0) { return hash64(s.data(), s.size(), seed); }
+
+// 128 bit hash value
+struct digest128 {
+    uint64 low, high;
+
+    bool empty() const { return low == 0 && high == 0; }
+    bool operator==(const digest128 &d) const { return low == d.low && high == d.high; }
+    bool operator!=(const digest128 &d) const { return !(*this == d); }
+};
+
+// fast 128 bit hash for content identification (MurmurHash3 x64 128), not cryptographic
+digest128 hash128(const void *data, size_t size, uint64 seed = 0);
+inline digest128 hash128(const stream &s, uint64 seed = 0) { return hash128(s.data(), s.size(), seed); }
+
+}}
@@ -20,6 +20,7 @@ int _CacheSize;
 bool _MMX;
 bool _SSE;
 bool _SSE2;
+bool _SSE42;
 bool _AMD3DNow;
 bool _AMD3DNowEx;
 bool _MMXEx;
@@ -73,6 +74,7 @@ void fetch(bool force = false) {
             _MMX = (out[3] & (1 << 23)) || false; // MMX Technology
             _SSE = (out[3] & (1 << 25)) || false; // SSE Extensions
             _SSE2 = (out[3] & (1 << 26)) || false; // SSE2 Extensions
+            _SSE42 = (out[2] & (1 << 20)) || false; // SSE4.2 Extensions (crc32)
         }
 
         // sprawdzamy czy sa dane z poziomu rozszerzonego
@@ -106,13 +108,10 @@ void fetch(bool force = false) {
             }
 
             // trim whitespaces
-            int w = 0;
-            for (uint i = 0; i < strlen(_BrandName); ++i) {
-                if (isWhiteSpace(_BrandName[i]))
-                    w = i;
-                else break;
-            }
-            strcpy(_BrandName, _BrandName + w + 1);
+            size_t w = 0;
+            while (_BrandName[w] != 0 && isWhiteSpace(_BrandName[w]))
+                ++w;
+            memmove(_BrandName, _BrandName + w, strlen(_BrandName + w) + 1); // ranges overlap
         }
 
         // rozszerzony 6
@@ -140,6 +139,7 @@ string toStr() {
                 detail::_MMXEx ? "MMXEx " : "",
                 detail::_SSE ? "SSE " : "",
                 detail::_SSE2 ? "SSE2 " : "",
+                detail::_SSE42 ? "SSE4.2 " : "",
                 detail::_AMD3DNow ? "AMD3DNow " : "",
                 detail::_AMD3DNowEx ? "AMD3DNowEx " : "",
                 detail::_CMOV ? "CMOV ]" : "]");
@@ -153,6 +153,7 @@ int getL2Associativity() { detail::fetch(); return detail::_L2Associativity; }
 bool supportMMX() { detail::fetch(); return detail::_MMX; }
 bool supportSSE() { detail::fetch(); return detail::_SSE; }
 bool supportSSE2() { detail::fetch(); return detail::_SSE2; }
+bool supportSSE42() { detail::fetch(); return detail::_SSE42; }
 bool support3DNow() { detail::fetch(); return detail::_AMD3DNow; }
 bool support3DNowEx() { detail::fetch(); return detail::_AMD3DNowEx; }
 bool supportMMXEx() { detail::fetch(); return detail::_MMXEx; }
@@ -28,6 +28,7 @@ int getL2Associativity();
 bool supportMMX();
 bool supportSSE();
 bool supportSSE2();
+bool supportSSE42();
 bool support3DNow();
 bool support3DNowEx();
 bool supportMMXEx();
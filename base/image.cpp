@@ -33,8 +33,8 @@ void PNGAPI read_data_fn(png_structp png_ptr, png_bytep outdata, png_size_t leng
     st->read(outdata, length);
 }
 
-void PNGAPI write_data_fn(png_structp png_ptr, png_bytep outdata, png_size_t length) {
-    stream *st = (stream*)png_ptr->io_ptr;
+template <typename T_STREAM> void PNGAPI write_data_fn(png_structp png_ptr, png_bytep outdata, png_size_t length) {
+    T_STREAM *st = (T_STREAM*)png_ptr->io_ptr;
     st->write(outdata, length);
 }
 
@@ -59,22 +59,22 @@ void term_source(j_decompress_ptr cinfo) {
 }
 
 // jpeg - zapis
-typedef struct {
+template <typename T_STREAM> struct jpeg_dst_mgr {
     struct jpeg_destination_mgr jdm;
-    stream *os;
+    T_STREAM *os;
     JOCTET buffer[4096];
-} jpeg_dst_mgr;
+};
 
 // ustawia poczatkowe wartosci bufora i ustala wskazniki
-void jpeg_init_destination(j_compress_ptr cinfo) {
-    jpeg_dst_mgr *dest = (jpeg_dst_mgr*)cinfo->dest;
+template <typename T_STREAM> void jpeg_init_destination(j_compress_ptr cinfo) {
+    jpeg_dst_mgr<T_STREAM> *dest = (jpeg_dst_mgr<T_STREAM>*)cinfo->dest;
     dest->jdm.next_output_byte = dest->buffer;
     dest->jdm.free_in_buffer = 4096;
 }
 
 // resetuje bufor - zapisuje wyniki na bufor i jako wolne dane podaje te same co na poczatku
-boolean jpeg_empty_output_buffer(j_compress_ptr cinfo) {
-    jpeg_dst_mgr *dest = (jpeg_dst_mgr*)cinfo->dest;
+template <typename T_STREAM> boolean jpeg_empty_output_buffer(j_compress_ptr cinfo) {
+    jpeg_dst_mgr<T_STREAM> *dest = (jpeg_dst_mgr<T_STREAM>*)cinfo->dest;
     dest->os->write(dest->buffer, 4096);
     dest->jdm.next_output_byte = dest->buffer;
     dest->jdm.free_in_buffer = 4096;
@@ -82,23 +82,23 @@ boolean jpeg_empty_output_buffer(j_compress_ptr cinfo) {
 }
 
 // koniec zapisu jpega - zapisyjemy ile trzeba do pliku
-void jpeg_term_destination(j_compress_ptr cinfo) {
-    jpeg_dst_mgr *dest = (jpeg_dst_mgr*)cinfo->dest;
+template <typename T_STREAM> void jpeg_term_destination(j_compress_ptr cinfo) {
+    jpeg_dst_mgr<T_STREAM> *dest = (jpeg_dst_mgr<T_STREAM>*)cinfo->dest;
     uint32 saved = 4096 - (uint32)dest->jdm.free_in_buffer;
     dest->os->write(dest->buffer, saved);
 }
 
 // ustawia wszystkie powyzsze funkcje do obslugi granitowego stream-a
-void jpeg_file_dest(j_compress_ptr cinfo, stream *oStream) {
+template <typename T_STREAM> void jpeg_file_dest(j_compress_ptr cinfo, T_STREAM *oStream) {
     if (cinfo->dest == NULL) // alokuje pamiec
-        cinfo->dest = (struct jpeg_destination_mgr*)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT, sizeof(jpeg_dst_mgr));
+        cinfo->dest = (struct jpeg_destination_mgr*)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT, sizeof(jpeg_dst_mgr<T_STREAM>));
 
-    jpeg_dst_mgr *dest = (jpeg_dst_mgr*)cinfo->dest;
+    jpeg_dst_mgr<T_STREAM> *dest = (jpeg_dst_mgr<T_STREAM>*)cinfo->dest;
 
     // tu ustawiam te powyzsze funkcje
-    dest->jdm.init_destination = jpeg_init_destination;
-    dest->jdm.empty_output_buffer = jpeg_empty_output_buffer;
-    dest->jdm.term_destination = jpeg_term_destination;
+    dest->jdm.init_destination = jpeg_init_destination<T_STREAM>;
+    dest->jdm.empty_output_buffer = jpeg_empty_output_buffer<T_STREAM>;
+    dest->jdm.term_destination = jpeg_term_destination<T_STREAM>;
 
     // i najwazniejsze - wskaznik do 'granitowego' stream-a
     dest->os = oStream;
@@ -409,7 +409,9 @@ bool toImage(const_stream s, image &i) {
     return true;
 }
 
-bool fromImage(const image &i, stream &s, imageCodec codec) {
+namespace detail {
+// encoder for both stream types
+template <typename T_STREAM> bool fromImage(const image &i, T_STREAM &s, imageCodec codec) {
     if (codec == imageCodecJPEG) {
         struct jpeg_compress_struct cinfo;
         struct jpeg_error_mgr jerr;
@@ -455,7 +457,7 @@ bool fromImage(const image &i, stream &s, imageCodec codec) {
         }
 
         // ustawia potrzebne informacje pliku
-        png_set_write_fn(png_ptr, &s, detail::write_data_fn, NULL);
+        png_set_write_fn(png_ptr, &s, detail::write_data_fn<T_STREAM>, NULL);
         int colorType;
         if (i.channels == 1)
             colorType = PNG_COLOR_TYPE_GRAY;
@@ -537,6 +539,15 @@ bool fromImage(const image &i, stream &s, imageCodec codec) {
     }
     return false;
 }
+} // > namespace detail
+
+bool fromImage(const image &i, stream &s, imageCodec codec) {
+    return detail::fromImage(i, s, codec);
+}
+
+bool fromImage(const image &i, chunked_stream &s, imageCodec codec) {
+    return detail::fromImage(i, s, codec);
+}
 
 }}
 
@@ -38,6 +38,7 @@ struct image {
 bool toImage(const_stream s, image &i);
 inline image toImage(const_stream s);
 bool fromImage(const image &i, stream &s, imageCodec codec);
+bool fromImage(const image &i, chunked_stream &s, imageCodec codec); //!< big outputs (no reallocations)
 inline stream fromImage(const image &i, imageCodec);
 
 #include "image.inc.hpp"
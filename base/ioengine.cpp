@@ -0,0 +1,306 @@
+#include "ioengine.hpp"
+#include "string.hpp"
+#include <atomic>
+#include <cerrno>
+#if defined(GE_PLATFORM_LINUX)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define GE_IO_URING
+#elif defined(GE_PLATFORM_WINDOWS)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace granite { namespace base {
+
+namespace {
+std::atomic<bool> _allowUring = {true};
+const size_t chunkSize = 1024 * 1024; // big transfers are split to parallel requests
+const size_t maxRequestSize = 1 << 30;
+
+#ifdef GE_IO_URING
+// ring indices are shared with kernel
+uint32 _loadAcquire(const uint32 *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+void _storeRelease(uint32 *p, uint32 v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+#endif
+}
+
+io_engine::io_engine(uint32 depth, size_t bufferSize, uint32 buffersCount)
+    : _ring(-1), _depth(0), _sq(nullptr), _cq(nullptr), _sqSize(0), _cqSize(0), _sqes(nullptr),
+      _sqHead(nullptr), _sqTail(nullptr), _sqMask(nullptr), _sqArray(nullptr),
+      _cqHead(nullptr), _cqTail(nullptr), _cqMask(nullptr), _cqes(nullptr), _registered(false), _vectored(false) {
+    _buffers.resize(buffersCount, std::vector<uint8>(bufferSize));
+    if (!_allowUring || !_setup(std::max<uint32>(depth, 1)))
+        return;
+
+    #ifdef GE_IO_URING
+    // register buffers (fails if locked memory limit is too low - normal requests are used then)
+    if (!_buffers.empty() && bufferSize > 0) {
+        std::vector<iovec> iov(_buffers.size());
+        for (size_t i = 0; i < _buffers.size(); ++i)
+            iov[i] = {_buffers[i].data(), _buffers[i].size()};
+        _registered = 0 == syscall(__NR_io_uring_register, _ring, IORING_REGISTER_BUFFERS, iov.data(), (unsigned)iov.size());
+    }
+    #endif
+}
+
+io_engine::~io_engine() {
+    _teardown();
+}
+
+void io_engine::_teardown() {
+    #ifdef GE_IO_URING
+    if (_ring >= 0) {
+        munmap(_sqes, _depth * sizeof(io_uring_sqe));
+        if (_cq != _sq)
+            munmap(_cq, _cqSize);
+        munmap(_sq, _sqSize);
+        ::close(_ring);
+    }
+    _ring = -1;
+    _registered = false;
+    #endif
+}
+
+bool io_engine::_setup(uint32 depth) {
+    #ifdef GE_IO_URING
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (fd < 0) {
+        const char *e = strerror(errno);
+        logInfo(strs("io_uring not available, using synchronous io, errno: ", e));
+        return false;
+    }
+
+    // map rings (one mapping for both on newer kernels)
+    _sqSize = p.sq_off.array + p.sq_entries * sizeof(uint32);
+    _cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+        _sqSize = _cqSize = std::max(_sqSize, _cqSize);
+    void *sq = mmap(NULL, _sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *cq = single ? sq : mmap(NULL, _cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, p.sq_entries * sizeof(io_uring_sqe));
+        if (cq != MAP_FAILED && cq != sq)
+            munmap(cq, _cqSize);
+        if (sq != MAP_FAILED)
+            munmap(sq, _sqSize);
+        ::close(fd);
+        logError("io_uring: could not map rings");
+        return false;
+    }
+
+    _sq = (uint8*)sq;
+    _cq = (uint8*)cq;
+    _sqes = sqes;
+    _sqHead = (uint32*)(_sq + p.sq_off.head);
+    _sqTail = (uint32*)(_sq + p.sq_off.tail);
+    _sqMask = (uint32*)(_sq + p.sq_off.ring_mask);
+    _sqArray = (uint32*)(_sq + p.sq_off.array);
+    _cqHead = (uint32*)(_cq + p.cq_off.head);
+    _cqTail = (uint32*)(_cq + p.cq_off.tail);
+    _cqMask = (uint32*)(_cq + p.cq_off.ring_mask);
+    _cqes = _cq + p.cq_off.cqes;
+    _depth = p.sq_entries;
+    _ring = fd;
+
+    // plain read/write requests need kernel 5.6 (same as probe), older kernels get readv/writev
+    std::vector<uint8> probe(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    io_uring_probe *ops = (io_uring_probe*)probe.data();
+    auto supported = [ops](uint8 op) { return op < ops->ops_len && (ops->ops[op].flags & IO_URING_OP_SUPPORTED) != 0; };
+    _vectored = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, ops, 256) < 0 ||
+                !supported(IORING_OP_READ) || !supported(IORING_OP_WRITE);
+    if (_vectored)
+        logInfo("io_uring: read/write requests not supported, using readv/writev");
+    return true;
+    #else
+    (void)depth;
+    return false;
+    #endif
+}
+
+bool io_engine::_submitUring(request *requests, size_t count) {
+    #ifdef GE_IO_URING
+    io_uring_sqe *sqes = (io_uring_sqe*)_sqes;
+    io_uring_cqe *cqes = (io_uring_cqe*)_cqes;
+    uint32 completed = 0;
+    auto reap = [&]() {
+        uint32 head = *_cqHead;
+        uint32 cqTail = _loadAcquire(_cqTail);
+        for (; head != cqTail; ++head) {
+            const io_uring_cqe &c = cqes[head & *_cqMask];
+            requests[c.user_data].result = c.res;
+            ++completed;
+        }
+        _storeRelease(_cqHead, head);
+    };
+
+    std::vector<iovec> iov(_vectored ? std::min<size_t>(_depth, count) : 0); // alive until batch completes
+    for (size_t first = 0; first < count; first += _depth) {
+        uint32 n = (uint32)std::min<size_t>(_depth, count - first);
+
+        // fill submission queue (only this thread writes tail)
+        uint32 tail = *_sqTail;
+        for (uint32 i = 0; i < n; ++i) {
+            request &r = requests[first + i];
+            bool fixed = _registered && r.buffer >= 0;
+            uint32 index = tail & *_sqMask;
+            io_uring_sqe *e = &sqes[index];
+            memset(e, 0, sizeof(io_uring_sqe));
+            if (r.write)
+                e->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+            else e->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            e->fd = r.fd;
+            e->addr = (uint64)(uintptr_t)r.data;
+            e->len = (uint32)std::min(r.size, maxRequestSize);
+            e->off = r.offset;
+            if (_vectored && !fixed) {
+                iov[i] = {r.data, e->len};
+                e->opcode = r.write ? IORING_OP_WRITEV : IORING_OP_READV;
+                e->addr = (uint64)(uintptr_t)&iov[i];
+                e->len = 1;
+            }
+            if (fixed)
+                e->buf_index = (uint16)r.buffer;
+            e->user_data = first + i;
+            _sqArray[index] = index;
+            ++tail;
+        }
+        _storeRelease(_sqTail, tail);
+
+        // submit all and wait for all completions in one call (usually)
+        completed = 0;
+        while (completed < n) {
+            uint32 pending = tail - _loadAcquire(_sqHead);
+            if (syscall(__NR_io_uring_enter, _ring, pending, n - completed, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                const char *e = strerror(errno);
+                logError(strs("io_uring: enter failed, errno: ", e));
+
+                // requests taken by kernel may still complete into caller buffers - wait for them
+                // before synchronous fallback, then drop ring (unsubmitted entries, no stale completions later)
+                reap();
+                uint32 inflight = (_loadAcquire(_sqHead) - (tail - n)) - completed;
+                while (inflight > 0) {
+                    if (syscall(__NR_io_uring_enter, _ring, 0, inflight, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                        break;
+                    uint32 before = completed;
+                    reap();
+                    inflight -= completed - before;
+                }
+                _teardown();
+                return false;
+            }
+            reap();
+        }
+    }
+    return true;
+    #else
+    (void)requests;
+    (void)count;
+    return false;
+    #endif
+}
+
+void io_engine::_submitSync(request &r) {
+    size_t size = std::min(r.size, maxRequestSize);
+    #ifdef GE_PLATFORM_WINDOWS
+    HANDLE h = (HANDLE)_get_osfhandle(r.fd);
+    OVERLAPPED o = {};
+    o.Offset = (DWORD)r.offset;
+    o.OffsetHigh = (DWORD)(r.offset >> 32);
+    DWORD done = 0;
+    BOOL ok = r.write ? WriteFile(h, r.data, (DWORD)size, &done, &o) : ReadFile(h, r.data, (DWORD)size, &done, &o);
+    if (ok || GetLastError() == ERROR_HANDLE_EOF)
+        r.result = done;
+    else r.result = -EIO;
+    #else
+    ssize_t done;
+    do {
+        done = r.write ? ::pwrite(r.fd, r.data, size, (off_t)r.offset) : ::pread(r.fd, r.data, size, (off_t)r.offset);
+    } while (done < 0 && errno == EINTR);
+    r.result = done < 0 ? -errno : done;
+    #endif
+}
+
+void io_engine::submit(request *requests, size_t count) {
+    bool uring = _ring >= 0;
+    if (uring) {
+        for (size_t i = 0; i < count; ++i)
+            requests[i].result = -EINPROGRESS;
+        if (_submitUring(requests, count))
+            return;
+    }
+
+    // fallback (or ring failure - finish what was not completed, ring is closed then)
+    for (size_t i = 0; i < count; ++i) {
+        if (!uring || requests[i].result == -EINPROGRESS)
+            _submitSync(requests[i]);
+    }
+}
+
+bool io_engine::_transfer(int fd, uint8 *data, size_t size, uint64 offset, bool write) {
+    const uint64 end = offset + size;
+    const size_t maxRequests = _ring >= 0 ? std::min<size_t>(_depth, 64) : 1;
+    request requests[64];
+
+    while (offset < end) {
+        // split to chunks submitted together
+        size_t n = 0;
+        for (uint64 o = offset; n < maxRequests && o < end; ++n) {
+            size_t s = (size_t)std::min<uint64>(end - o, maxRequests > 1 ? chunkSize : maxRequestSize);
+            requests[n] = {fd, data + (o - offset), s, o, write, -1, 0};
+            o += s;
+        }
+        submit(requests, n);
+
+        // continue after first incomplete request (end of file, interrupted transfer)
+        uint64 next = offset;
+        for (size_t i = 0; i < n; ++i) {
+            const request &r = requests[i];
+            if (r.result < 0 && r.result != -EINTR && r.result != -EAGAIN)
+                return false;
+            if (r.result == 0 && r.size > 0)
+                return false; // unexpected end of file
+            if (r.result < 0)
+                break;
+            next = r.offset + r.result;
+            if ((size_t)r.result != r.size)
+                break;
+        }
+        data += next - offset;
+        offset = next;
+    }
+    return true;
+}
+
+bool io_engine::read(int fd, void *data, size_t size, uint64 offset) {
+    return _transfer(fd, (uint8*)data, size, offset, false);
+}
+
+bool io_engine::write(int fd, const void *data, size_t size, uint64 offset) {
+    return _transfer(fd, (uint8*)const_cast<void*>(data), size, offset, true);
+}
+
+bool io_engine::uring() const { return _ring >= 0; }
+uint8 *io_engine::buffer(uint32 index) { return _buffers[index].data(); }
+size_t io_engine::bufferSize() const { return _buffers.empty() ? 0 : _buffers[0].size(); }
+uint32 io_engine::buffersCount() const { return (uint32)_buffers.size(); }
+
+io_engine &io_engine::local() {
+    thread_local io_engine engine;
+    return engine;
+}
+
+void io_engine::allowUring(bool doAllow) {
+    _allowUring = doAllow;
+}
+
+}}
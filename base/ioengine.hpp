@@ -0,0 +1,70 @@
+/*
+ * granite engine 1.0 | 2006-2026 | Jakub Duracz | jakubduracz@gmail.com | http://jakubduracz.com
+ * file: ioengine
+ * created: 19-10-2026
+ *
+ * description: batched positional file io (io_uring on linux, synchronous fallback)
+ *
+ * changelog:
+ * - 19-10-2026: file created
+ */
+
+#pragma once
+#include "includes.hpp"
+
+namespace granite { namespace base {
+
+// positional reads/writes on file descriptors submitted in batches
+// linux: io_uring (one syscall per batch, registered buffers skip per request page pinning)
+// fallback: pread/pwrite (ReadFile/WriteFile on windows) one by one
+class io_engine {
+public:
+    struct request {
+        int fd;
+        void *data;
+        size_t size;
+        uint64 offset;
+        bool write;
+        int buffer; //!< registered buffer index (data must point inside it), -1 if none
+        int64 result; //!< bytes transferred or -errno
+    };
+
+private:
+    int _ring;
+    uint32 _depth;
+    uint8 *_sq, *_cq; // mapped rings
+    size_t _sqSize, _cqSize;
+    void *_sqes;
+    uint32 *_sqHead, *_sqTail, *_sqMask, *_sqArray;
+    uint32 *_cqHead, *_cqTail, *_cqMask;
+    void *_cqes;
+    std::vector<std::vector<uint8>> _buffers;
+    bool _registered;
+    bool _vectored; // readv/writev requests (kernel older than 5.6, no plain read/write)
+
+    bool _setup(uint32 depth);
+    void _teardown();
+    bool _submitUring(request *requests, size_t count);
+    static void _submitSync(request &r);
+    bool _transfer(int fd, uint8 *data, size_t size, uint64 offset, bool write);
+
+public:
+    io_engine(uint32 depth = 32, size_t bufferSize = 0, uint32 buffersCount = 0);
+    ~io_engine();
+    io_engine(const io_engine &) = delete;
+    io_engine &operator=(const io_engine &) = delete;
+
+    bool uring() const; //!< io_uring is used
+    uint8 *buffer(uint32 index); //!< registered buffer (allocated in constructor)
+    size_t bufferSize() const;
+    uint32 buffersCount() const;
+
+    void submit(request *requests, size_t count); //!< runs batch and waits for all requests, check request::result (ring failure switches engine to synchronous io)
+    bool read(int fd, void *data, size_t size, uint64 offset); //!< reads whole range (big reads are split and run in parallel)
+    bool write(int fd, const void *data, size_t size, uint64 offset); //!< writes whole range
+
+    static io_engine &local(); //!< per thread engine without registered buffers
+    static void allowUring(bool doAllow); //!< affects engines created later (enabled by default)
+};
+
+}}
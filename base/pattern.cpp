@@ -0,0 +1,530 @@
+#include "pattern.hpp"
+#include "log.hpp"
+#include "string.hpp"
+#include <bitset>
+#include <mutex>
+#include <regex>
+#include <unordered_map>
+
+namespace granite { namespace base {
+
+struct pattern_matcher::fallback {
+    std::regex re;
+};
+
+namespace {
+typedef std::bitset<256> char_set;
+
+const size_t maxNfaStates = 8192;
+const size_t maxDfaStates = 1024;
+const size_t cacheSize = 64;
+
+// pattern syntax tree
+struct pattern_node {
+    enum kind {
+        chars,
+        concat,
+        alternate,
+        repeat
+    } k;
+    char_set set; // chars
+    std::vector<int> items; // concat/alternate, repeat - one item
+    int min, max; // repeat, max -1 - unbounded
+};
+
+// recursive descent parser, sets unsupported for constructs only std::regex knows
+struct pattern_parser {
+    const string &p;
+    size_t pos = 0;
+    bool glob;
+    bool unsupported = false;
+    std::vector<pattern_node> nodes;
+
+    pattern_parser(const string &pattern, bool isGlob) : p(pattern), glob(isGlob) {}
+
+    bool end() const { return pos >= p.size(); }
+    char peek() const { return p[pos]; }
+
+    int add(pattern_node &&n) {
+        nodes.push_back(std::move(n));
+        return (int)nodes.size() - 1;
+    }
+
+    int chars(const char_set &s) {
+        pattern_node n = {pattern_node::chars, s, {}, 0, 0};
+        return add(std::move(n));
+    }
+
+    int list(pattern_node::kind k, std::vector<int> &&items) {
+        pattern_node n = {k, char_set(), std::move(items), 0, 0};
+        return add(std::move(n));
+    }
+
+    int fail() {
+        unsupported = true;
+        return list(pattern_node::concat, {});
+    }
+
+    // \d \w \s and negations, false if not class escape
+    static bool classEscape(char c, char_set &s) {
+        char_set r;
+        char l = (char)tolower(c);
+        if (l == 'd') {
+            for (int i = '0'; i <= '9'; ++i)
+                r.set(i);
+        }
+        else if (l == 'w') {
+            for (int i = 0; i < 256; ++i)
+                r[i] = isalnum(i) != 0 || i == '_';
+        }
+        else if (l == 's') {
+            for (int i : {' ', '\t', '\n', '\r', '\f', '\v'})
+                r.set(i);
+        }
+        else return false;
+        s |= c == l ? r : ~r;
+        return true;
+    }
+
+    // single character escape (after backslash), -1 if not supported
+    int charEscape() {
+        char c = p[pos++];
+        switch (c) {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case '0': return 0;
+        case 'x': {
+            if (pos + 2 > p.size() || !isxdigit((uint8)p[pos]) || !isxdigit((uint8)p[pos + 1]))
+                return -1;
+            int v = (int)std::stoi(p.substr(pos, 2), nullptr, 16);
+            pos += 2;
+            return v;
+        }
+        default:
+            // escaped punctuation is literal, letters/digits have other meaning (backreferences, assertions)
+            return isalnum((uint8)c) && !glob ? -1 : (uint8)c;
+        }
+    }
+
+    // [...] class (after [)
+    int charClass() {
+        char_set s;
+        bool negate = !end() && (peek() == '^' || (glob && peek() == '!'));
+        if (negate)
+            ++pos;
+        bool first = true;
+        while (!end() && (peek() != ']' || (glob && first))) {
+            first = false;
+            int lo;
+            char c = p[pos++];
+            if (c == '\\' && !end()) {
+                if (classEscape(peek(), s)) {
+                    ++pos;
+                    continue;
+                }
+                if ((lo = charEscape()) < 0)
+                    return fail();
+            }
+            else if (c == '[' && !end() && (peek() == ':' || peek() == '=' || peek() == '.'))
+                return fail(); // posix classes
+            else lo = (uint8)c;
+
+            // range
+            int hi = lo;
+            if (pos + 1 < p.size() && peek() == '-' && p[pos + 1] != ']') {
+                ++pos;
+                char h = p[pos++];
+                if (h == '\\' && !end()) {
+                    if ((hi = charEscape()) < 0)
+                        return fail();
+                }
+                else hi = (uint8)h;
+                if (hi < lo)
+                    return fail();
+            }
+            for (int i = lo; i <= hi; ++i)
+                s.set(i);
+        }
+        if (end())
+            return fail(); // unterminated
+        ++pos;
+        if (negate) {
+            s.flip();
+            if (glob)
+                s.reset('/');
+        }
+        return chars(s);
+    }
+
+    //- regex
+    int regexAlternate() {
+        std::vector<int> items = {regexConcat()};
+        while (!end() && peek() == '|') {
+            ++pos;
+            items.push_back(regexConcat());
+        }
+        return items.size() == 1 ? items[0] : list(pattern_node::alternate, std::move(items));
+    }
+
+    int regexConcat() {
+        std::vector<int> items;
+        while (!end() && peek() != '|' && peek() != ')')
+            items.push_back(regexRepeat());
+        return items.size() == 1 ? items[0] : list(pattern_node::concat, std::move(items));
+    }
+
+    int regexRepeat() {
+        int atom = regexAtom();
+        while (!end()) {
+            int min, max;
+            char c = peek();
+            if (c == '*')
+                min = 0, max = -1;
+            else if (c == '+')
+                min = 1, max = -1;
+            else if (c == '?')
+                min = 0, max = 1;
+            else if (c == '{') {
+                size_t close = p.find('}', pos);
+                if (close == string::npos)
+                    return fail();
+                string r = p.substr(pos + 1, close - pos - 1);
+                size_t comma = r.find(',');
+                string a = r.substr(0, comma), b = comma == string::npos ? a : r.substr(comma + 1);
+                auto digits = [](const string &s) { return !s.empty() && s.size() < 4 && std::all_of(s.begin(), s.end(), ::isdigit); };
+                if (!digits(a) || (!b.empty() && !digits(b)))
+                    return fail();
+                min = std::stoi(a);
+                max = b.empty() ? -1 : std::stoi(b);
+                if (max >= 0 && max < min)
+                    return fail();
+                pos = close;
+            }
+            else break;
+            ++pos;
+            if (!end() && peek() == '?')
+                ++pos; // lazy quantifier matches the same strings
+            pattern_node n = {pattern_node::repeat, char_set(), {atom}, min, max};
+            atom = add(std::move(n));
+        }
+        return atom;
+    }
+
+    int regexAtom() {
+        char c = p[pos++];
+        switch (c) {
+        case '(': {
+            if (!end() && peek() == '?') {
+                if (pos + 1 < p.size() && p[pos + 1] == ':')
+                    pos += 2;
+                else return fail(); // lookahead
+            }
+            int r = regexAlternate();
+            if (end() || peek() != ')')
+                return fail();
+            ++pos;
+            return r;
+        }
+        case '[':
+            return charClass();
+        case '.': {
+            char_set s;
+            s.set();
+            s.reset('\n');
+            s.reset('\r');
+            return chars(s);
+        }
+        case '^':
+            return pos == 1 ? list(pattern_node::concat, {}) : fail(); // whole string is matched anyway
+        case '$':
+            return end() ? list(pattern_node::concat, {}) : fail();
+        case '\\': {
+            if (end())
+                return fail();
+            char_set s;
+            if (classEscape(peek(), s)) {
+                ++pos;
+                return chars(s);
+            }
+            int e = charEscape();
+            if (e < 0)
+                return fail();
+            s.set(e);
+            return chars(s);
+        }
+        case '*': case '+': case '?': case '{': case '}': case ']': case ')':
+            return fail();
+        default: {
+            char_set s;
+            s.set((uint8)c);
+            return chars(s);
+        }
+        }
+    }
+
+    //- glob
+    int globConcat(bool inBraces) {
+        std::vector<int> items;
+        while (!end() && !(inBraces && (peek() == ',' || peek() == '}'))) {
+            char c = p[pos++];
+            char_set s;
+            if (c == '*') {
+                s.set();
+                s.reset('/');
+                pattern_node n = {pattern_node::repeat, char_set(), {chars(s)}, 0, -1};
+                items.push_back(add(std::move(n)));
+            }
+            else if (c == '?') {
+                s.set();
+                s.reset('/');
+                items.push_back(chars(s));
+            }
+            else if (c == '[')
+                items.push_back(charClass());
+            else if (c == '{') {
+                std::vector<int> alternatives = {globConcat(true)};
+                while (!end() && peek() == ',') {
+                    ++pos;
+                    alternatives.push_back(globConcat(true));
+                }
+                if (end())
+                    return fail();
+                ++pos;
+                items.push_back(list(pattern_node::alternate, std::move(alternatives)));
+            }
+            else {
+                if (c == '\\' && !end())
+                    c = p[pos++];
+                s.set((uint8)c);
+                items.push_back(chars(s));
+            }
+        }
+        return list(pattern_node::concat, std::move(items));
+    }
+
+    int parse() {
+        if (glob)
+            return globConcat(false);
+        int r = regexAlternate();
+        if (!end())
+            return fail(); // unbalanced )
+        return r;
+    }
+};
+
+// thompson nfa, state either consumes char from set (-> out) or has epsilon edges (out, out2)
+struct nfa {
+    struct state {
+        int set; // index to sets, -1 - epsilon state
+        int out, out2;
+    };
+    std::vector<state> states;
+    std::vector<char_set> sets;
+    const std::vector<pattern_node> &nodes;
+    bool overflow = false;
+
+    nfa(const std::vector<pattern_node> &n) : nodes(n) {}
+
+    int add(int set, int out = -1, int out2 = -1) {
+        if (states.size() >= maxNfaStates)
+            overflow = true;
+        states.push_back({set, out, out2});
+        return (int)states.size() - 1;
+    }
+
+    // returns <start, end> of fragment, end is epsilon state with free out
+    std::tuple<int, int> build(int node) {
+        if (overflow) {
+            int e = add(-1);
+            return std::make_tuple(e, e);
+        }
+        const pattern_node &n = nodes[node];
+        if (n.k == pattern_node::chars) {
+            int e = add(-1);
+            sets.push_back(n.set);
+            return std::make_tuple(add((int)sets.size() - 1, e), e);
+        }
+        if (n.k == pattern_node::alternate) {
+            int e = add(-1);
+            int start = -1;
+            for (size_t i = n.items.size(); i-- > 0;) {
+                int s, fe;
+                std::tie(s, fe) = build(n.items[i]);
+                states[fe].out = e;
+                start = start < 0 ? s : add(-1, s, start);
+            }
+            return std::make_tuple(start, e);
+        }
+
+        // concatenation, repeat is unrolled to min copies followed by loop or (max - min) optional copies
+        std::vector<int> items = n.items;
+        if (n.k == pattern_node::repeat)
+            items.assign(n.min, n.items[0]);
+        int start = add(-1), e = start;
+        for (int item : items) {
+            int s, fe;
+            std::tie(s, fe) = build(item);
+            states[e].out = s;
+            e = fe;
+        }
+        if (n.k != pattern_node::repeat)
+            return std::make_tuple(start, e);
+
+        int optional = n.max < 0 ? 1 : n.max - n.min;
+        for (int i = 0; i < optional && !overflow; ++i) {
+            int s, fe;
+            std::tie(s, fe) = build(n.items[0]);
+            int end = add(-1);
+            int split = add(-1, s, end);
+            states[e].out = split;
+            states[fe].out = n.max < 0 ? split : end;
+            e = end;
+        }
+        return std::make_tuple(start, e);
+    }
+
+    // add state and states reachable by epsilon edges
+    void closure(int s, std::vector<int> &r, std::vector<uint8> &seen) const {
+        std::vector<int> stack = {s};
+        while (!stack.empty()) {
+            int i = stack.back();
+            stack.pop_back();
+            if (i < 0 || seen[i])
+                continue;
+            seen[i] = 1;
+            r.push_back(i);
+            if (states[i].set < 0) {
+                stack.push_back(states[i].out2);
+                stack.push_back(states[i].out);
+            }
+        }
+    }
+};
+
+std::mutex _cacheLock;
+std::unordered_map<string, std::shared_ptr<const pattern_matcher>> _cache;
+}
+
+pattern_matcher::pattern_matcher(const string &pattern, syntax s) : _classesCount(0), _valid(true) {
+    if (_compile(pattern, s))
+        return;
+
+    // constructs not supported by dfa
+    _table.clear();
+    _accept.clear();
+    try {
+        _fallback = std::make_shared<fallback>();
+        _fallback->re = std::regex(pattern);
+    }
+    catch (const std::regex_error &e) {
+        logError(strs("invalid pattern: ", pattern, " (", e.what(), ")"));
+        _valid = false;
+    }
+}
+
+bool pattern_matcher::_compile(const string &pattern, syntax s) {
+    pattern_parser parser(pattern, s == glob);
+    int root = parser.parse();
+    if (parser.unsupported) {
+        if (s == glob) {
+            logError(strs("invalid glob pattern: ", pattern));
+            _valid = false;
+            return true; // nothing matches
+        }
+        return false;
+    }
+
+    nfa n(parser.nodes);
+    int start, final;
+    std::tie(start, final) = n.build(root);
+    if (n.overflow)
+        return false;
+
+    // bytes that behave the same in all sets share one column
+    std::map<std::vector<bool>, uint32> signatures;
+    std::vector<int> representative;
+    for (int b = 0; b < 256; ++b) {
+        std::vector<bool> sig(n.sets.size());
+        for (size_t i = 0; i < n.sets.size(); ++i)
+            sig[i] = n.sets[i][b];
+        auto c = signatures.emplace(sig, (uint32)signatures.size());
+        if (c.second)
+            representative.push_back(b);
+        _classes[b] = (uint8)c.first->second;
+    }
+    _classesCount = (uint32)signatures.size();
+
+    // subset construction
+    std::map<std::vector<int>, int> dfaStates;
+    std::vector<std::vector<int>> pending;
+    std::vector<uint8> seen(n.states.size());
+    auto state = [&](std::vector<int> &&set) {
+        std::sort(set.begin(), set.end());
+        auto d = dfaStates.emplace(set, (int)dfaStates.size());
+        if (d.second) {
+            _accept.push_back(std::binary_search(set.begin(), set.end(), final) ? 1 : 0);
+            pending.push_back(std::move(set));
+        }
+        return d.first->second;
+    };
+    std::vector<int> initial;
+    n.closure(start, initial, seen);
+    state(std::move(initial));
+
+    for (size_t d = 0; d < pending.size(); ++d) {
+        if (pending.size() > maxDfaStates)
+            return false;
+        _table.resize((d + 1) * _classesCount, -1);
+        for (uint32 c = 0; c < _classesCount; ++c) {
+            std::vector<int> next;
+            std::fill(seen.begin(), seen.end(), 0);
+            for (int i : pending[d]) {
+                const nfa::state &st = n.states[i];
+                if (st.set >= 0 && n.sets[st.set][representative[c]])
+                    n.closure(st.out, next, seen);
+            }
+            if (!next.empty())
+                _table[d * _classesCount + c] = state(std::move(next));
+        }
+    }
+    return true;
+}
+
+bool pattern_matcher::valid() const {
+    return _valid;
+}
+
+bool pattern_matcher::compiled() const {
+    return _valid && !_fallback;
+}
+
+bool pattern_matcher::match(const char *s, size_t size) const {
+    if (!_valid)
+        return false;
+    if (_fallback)
+        return std::regex_match(s, s + size, _fallback->re);
+
+    int32 state = 0;
+    for (size_t i = 0; i < size; ++i) {
+        state = _table[state * _classesCount + _classes[(uint8)s[i]]];
+        if (state < 0)
+            return false;
+    }
+    return _accept[state] != 0;
+}
+
+std::shared_ptr<const pattern_matcher> pattern_matcher::cached(const string &pattern, syntax s) {
+    string key = strs(s == glob ? "g:" : "r:", pattern);
+    std::lock_guard<std::mutex> lock(_cacheLock);
+    auto m = _cache.find(key);
+    if (m != _cache.end())
+        return m->second;
+    if (_cache.size() >= cacheSize)
+        _cache.clear(); // patterns are usually few, compiling again is cheap
+    return _cache[key] = std::make_shared<pattern_matcher>(pattern, s);
+}
+
+}}
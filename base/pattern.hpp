@@ -0,0 +1,51 @@
+/*
+ * granite engine 1.0 | 2006-2026 | Jakub Duracz | jakubduracz@gmail.com | http://jakubduracz.com
+ * file: pattern
+ * created: 19-10-2026
+ *
+ * description: compiled name patterns (regex subset and globs matched by DFA)
+ *
+ * changelog:
+ * - 19-10-2026: file created
+ */
+
+#pragma once
+#include "includes.hpp"
+
+namespace granite { namespace base {
+
+// whole string matcher compiled once (immutable, may be used from many threads)
+// regex (ECMAScript): literals, ., [] classes, \d \w \s escapes, groups, |, * + ? {m,n} are compiled to DFA,
+// other constructs (backreferences, assertions) fall back to std::regex
+// glob: * and ? (not matching /), [] classes ([!...] negated), {a,b} alternatives, \ escapes
+class pattern_matcher {
+public:
+    enum syntax {
+        regex,
+        glob
+    };
+
+private:
+    struct fallback;
+
+    uint8 _classes[256]; // byte -> equivalence class
+    uint32 _classesCount;
+    std::vector<int32> _table; // state * classesCount + class -> next state, -1 - no match
+    std::vector<uint8> _accept;
+    std::shared_ptr<fallback> _fallback;
+    bool _valid;
+
+    bool _compile(const string &pattern, syntax s);
+
+public:
+    pattern_matcher(const string &pattern, syntax s = regex);
+
+    bool valid() const; //!< false if pattern is invalid (nothing matches)
+    bool compiled() const; //!< matched by DFA (false - std::regex is used)
+    bool match(const char *s, size_t size) const;
+    bool match(const string &s) const { return match(s.data(), s.size()); }
+
+    static std::shared_ptr<const pattern_matcher> cached(const string &pattern, syntax s = regex); //!< compiled once, reused across calls
+};
+
+}}
@@ -14,15 +14,37 @@
 #include "includes.hpp"
 #include "log.hpp"
 #include "string.hpp"
+#include <mutex>
+#ifdef GE_COMPILER_VISUAL
+#include <intrin.h>
+#endif
 
 namespace granite { namespace base {
 
+// variable length integers (LEB128, signed values are zigzag encoded first)
+inline uint64 zigzagEncode(int64 v);
+inline int64 zigzagDecode(uint64 v);
+inline size_t varintEncode(uint64 v, uint8 *out); //!< out must hold at least 10 bytes, returns bytes written
+inline size_t varintDecode(const uint8 *in, size_t size, uint64 &v); //!< returns bytes read, 0 if malformed
+inline size_t varintDecode(const uint8 *in, size_t size, uint64 *out, size_t count); //!< bulk (SIMD) decoder, returns bytes read, 0 if malformed
+
 class stream
 {
     std::vector<uint8> _mem;
     size_t _pos;
+
+    // external memory (memory mapped files), copied to _mem when stream must grow
+    // (or on first mutable access if memory is read only)
+    uint8 *_ext = nullptr;
+    size_t _extSize = 0;
+    bool _extReadOnly = false;
+    std::shared_ptr<void> _extOwner;
+    inline void _detach(size_t cap = 0);
+
 public:
     inline stream(size_t size = 0);
+    inline stream(uint8 *data, size_t size, std::shared_ptr<void> owner); //!< adopts external memory, owner keeps it alive
+    inline stream(const uint8 *data, size_t size, std::shared_ptr<void> owner); //!< read only view, copied on first non const data() access
     inline ~stream();
     inline stream(stream &&s);
     inline stream(const stream &s);
@@ -40,6 +62,7 @@ public:
 
     inline uint8 *data();
     inline const uint8 *data() const;
+    inline bool external() const;
 
     // rw pointer stuff
     inline size_t read(void *data, size_t size);
@@ -55,6 +78,15 @@ public:
     template <typename T> inline void write(const T &in);
     template <typename T> inline size_t read(std::vector<T> &out);
     template <typename T> inline void write(const std::vector<T> &in);
+
+    // compact encoding
+    inline void writeVarint(uint64 v);
+    inline size_t readVarint(uint64 &v);
+    inline void writeZigzag(int64 v);
+    inline size_t readZigzag(int64 &v);
+    inline size_t readVarints(uint64 *out, size_t count);
+    inline void writeCompact(const string &s); //!< varint length, then string
+    inline size_t readCompact(string &s);
 };
 
 class const_stream {
@@ -69,6 +101,47 @@ public:
     inline const uint8 *data() const;
 };
 
+// pool of fixed size memory chunks (thread safe)
+class chunk_pool {
+    const size_t _chunkSize;
+    const size_t _maxFree;
+    std::mutex _mtx;
+    std::vector<uint8*> _free;
+public:
+    inline chunk_pool(size_t chunkSize, size_t maxFree = 64);
+    inline ~chunk_pool();
+    inline size_t chunkSize() const;
+    inline uint8 *acquire();
+    inline void release(uint8 *chunk);
+    inline static chunk_pool &shared(); //!< 64kB chunks
+};
+
+// write only stream made of pooled chunks, growing does not move written data
+class chunked_stream {
+    chunk_pool *_pool;
+    std::vector<uint8*> _chunks;
+    size_t _size;
+public:
+    inline chunked_stream(chunk_pool &pool = chunk_pool::shared());
+    inline ~chunked_stream();
+    inline chunked_stream(chunked_stream &&s);
+    inline chunked_stream &operator=(chunked_stream &&s);
+    chunked_stream(const chunked_stream &s) = delete;
+    chunked_stream &operator=(const chunked_stream &s) = delete;
+
+    inline size_t size() const;
+    inline void clear();
+
+    inline void write(const void *data, size_t size);
+    inline void write(const chunked_stream &s);
+    template <typename T> inline void write(const T &in);
+    inline void writeVarint(uint64 v);
+    inline void writeZigzag(int64 v);
+
+    inline std::vector<const_stream> gather() const; //!< written chunks in order (for writev/fwrite)
+    inline stream flatten() const; //!< contiguous copy, use only when really needed
+};
+
 #include "stream.inc.hpp"
 
 }}
@@ -1,11 +1,26 @@
 //- vector
-size_t stream::size() const { return _mem.size(); }
-void stream::resize(size_t cap) { _mem.resize(cap); _pos = std::min(_pos, cap); }
-void stream::resize(size_t cap, const uint8 &val) { _mem.resize(cap, val); _pos = std::min(_pos, cap); }
-void stream::reserve(size_t cap) { _mem.reserve(cap); }
-uint8 *stream::data() { return _mem.data(); }
-const uint8 *stream::data() const { return _mem.data(); }
-void stream::clear() { _pos = 0; return _mem.clear(); }
+size_t stream::size() const { return _ext ? _extSize : _mem.size(); }
+void stream::resize(size_t cap) { if (_ext && cap <= _extSize) _extSize = cap; else { _detach(cap); _mem.resize(cap); } _pos = std::min(_pos, cap); }
+void stream::resize(size_t cap, const uint8 &val) { _detach(cap); _mem.resize(cap, val); _pos = std::min(_pos, cap); }
+void stream::reserve(size_t cap) { if (!_ext || cap > _extSize) { _detach(cap); _mem.reserve(cap); } }
+uint8 *stream::data() { if (_extReadOnly) _detach(); return _ext ? _ext : _mem.data(); }
+const uint8 *stream::data() const { return _ext ? _ext : _mem.data(); }
+bool stream::external() const { return _ext != nullptr; }
+void stream::clear() { _pos = 0; _ext = nullptr; _extSize = 0; _extReadOnly = false; _extOwner.reset(); return _mem.clear(); }
+
+// copies external memory to own buffer
+void stream::_detach(size_t cap) {
+    if (_ext) {
+        std::vector<uint8> m;
+        m.reserve(std::max(cap, _extSize));
+        m.assign(_ext, _ext + _extSize);
+        _mem = std::move(m);
+        _ext = nullptr;
+        _extSize = 0;
+        _extReadOnly = false;
+        _extOwner.reset();
+    }
+}
 
 //- stream
 stream::stream(size_t size) {
@@ -14,49 +29,75 @@ stream::stream(size_t size) {
     _pos = 0;
 }
 
+stream::stream(uint8 *data, size_t size, std::shared_ptr<void> owner)
+    : _pos(0), _ext(data), _extSize(size), _extOwner(std::move(owner)) { }
+
+stream::stream(const uint8 *data, size_t size, std::shared_ptr<void> owner)
+    : _pos(0), _ext(const_cast<uint8*>(data)), _extSize(size), _extReadOnly(true), _extOwner(std::move(owner)) { }
+
 stream::~stream() { }
 
 stream::stream(stream &&s) {
     _mem = std::move(s._mem);
     _pos = std::move(s._pos);
+    _ext = s._ext;
+    _extSize = s._extSize;
+    _extReadOnly = s._extReadOnly;
+    _extOwner = std::move(s._extOwner);
     s._pos = 0;
+    s._ext = nullptr;
+    s._extSize = 0;
+    s._extReadOnly = false;
 }
 
 stream::stream(const stream &s) {
-    _mem = s._mem;
+    _mem.assign(s.data(), s.data() + s.size());
     _pos = s._pos;
 }
 
 stream &stream::operator=(stream &&s) {
     _mem = std::move(s._mem);
     _pos = std::move(s._pos);
+    _ext = s._ext;
+    _extSize = s._extSize;
+    _extReadOnly = s._extReadOnly;
+    _extOwner = std::move(s._extOwner);
     s._pos = 0;
+    s._ext = nullptr;
+    s._extSize = 0;
+    s._extReadOnly = false;
     return *this;
 }
 
 stream &stream::operator=(const stream &s) {
-    _mem = s._mem;
-    _pos = s._pos;
+    if (this != &s) {
+        clear();
+        _mem.assign(s.data(), s.data() + s.size());
+        _pos = s._pos;
+    }
     return *this;
 }
 
 size_t stream::read(void *data, size_t size) {
-    size_t n = std::min(_mem.size() - _pos, size);
-    memcpy(data, &_mem[_pos], n);
+    size_t n = std::min(this->size() - _pos, size);
+    memcpy(data, static_cast<const stream*>(this)->data() + _pos, n);
     _pos += n;
     return n;
 }
 
 size_t stream::read_const(void *data, size_t size) const {
-    size_t n = std::min(_mem.size() - _pos, size);
-    memcpy(data, &_mem[_pos], n);
+    size_t n = std::min(this->size() - _pos, size);
+    memcpy(data, this->data() + _pos, n);
     return n;
 }
 
 void stream::write(const void *data, size_t size) {
-    size_t need = std::max(_mem.size(), _pos + size);
-    _mem.resize(need);
-    memcpy(&_mem[_pos], data, size);
+    size_t need = std::max(this->size(), _pos + size);
+    if (need > this->size()) {
+        _detach(need);
+        _mem.resize(need);
+    }
+    memcpy(this->data() + _pos, data, size);
     _pos += size;
 }
 
@@ -65,12 +106,12 @@ void stream::setPosFromBegin(size_t bytes) {
 }
 
 void stream::setPosFromEnd(size_t bytes) {
-    gassert(_mem.size() >= bytes, "index out of range");
-    _pos = _mem.size() - bytes;
+    gassert(size() >= bytes, "index out of range");
+    _pos = size() - bytes;
 }
 
 void stream::setPosOffset(size_t bytes) {
-    gassert(_pos + bytes < _mem.size(), "index out of range");
+    gassert(_pos + bytes < size(), "index out of range");
     _pos += bytes;
 }
 
@@ -79,6 +120,7 @@ size_t stream::getPos() const {
 }
 
 void stream::expand(size_t additional_cap) {
+    _detach();
     _mem.reserve(_mem.capacity() + additional_cap);
 }
 
@@ -127,14 +169,280 @@ template <typename T> inline void stream::write(const std::vector<T> &in) {
     }
 }
 
+// compact encoding
+void stream::writeVarint(uint64 v) {
+    uint8 b[10];
+    write(b, varintEncode(v, b));
+}
+
+size_t stream::readVarint(uint64 &v) {
+    size_t n = varintDecode(static_cast<const stream*>(this)->data() + _pos, size() - _pos, v);
+    _pos += n;
+    return n;
+}
+
+void stream::writeZigzag(int64 v) {
+    writeVarint(zigzagEncode(v));
+}
+
+size_t stream::readZigzag(int64 &v) {
+    uint64 u;
+    size_t n = readVarint(u);
+    v = zigzagDecode(u);
+    return n;
+}
+
+size_t stream::readVarints(uint64 *out, size_t count) {
+    size_t n = varintDecode(static_cast<const stream*>(this)->data() + _pos, size() - _pos, out, count);
+    _pos += n;
+    return n;
+}
+
+void stream::writeCompact(const string &s) {
+    writeVarint(s.size());
+    write(s.data(), s.size() * sizeof(string::value_type));
+}
+
+size_t stream::readCompact(string &s) {
+    uint64 len;
+    size_t r = readVarint(len);
+    if (r > 0 && len <= size() - _pos) {
+        s.resize(len);
+        return read(&s[0], len * sizeof(string::value_type)) + r;
+    }
+    return 0;
+}
+
+//- varints
+namespace detail {
+inline uint32 ctz32(uint32 v) {
+    #ifdef GE_COMPILER_VISUAL
+    unsigned long r;
+    _BitScanForward(&r, v);
+    return (uint32)r;
+    #else
+    return (uint32)__builtin_ctz(v);
+    #endif
+}
+}
+
+uint64 zigzagEncode(int64 v) {
+    return ((uint64)v << 1) ^ (uint64)(v >> 63);
+}
+
+int64 zigzagDecode(uint64 v) {
+    return (int64)(v >> 1) ^ -(int64)(v & 1);
+}
+
+size_t varintEncode(uint64 v, uint8 *out) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8)v | 0x80;
+        v >>= 7;
+    }
+    out[n++] = (uint8)v;
+    return n;
+}
+
+size_t varintDecode(const uint8 *in, size_t size, uint64 &v) {
+    v = 0;
+    for (size_t i = 0; i < size && i < 10; ++i) {
+        v |= (uint64)(in[i] & 0x7f) << (7 * i);
+        if ((in[i] & 0x80) == 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+size_t varintDecode(const uint8 *in, size_t size, uint64 *out, size_t count) {
+    size_t p = 0, n = 0;
+
+    // decode 16 byte windows, continuation bits of whole window are fetched with one movemask
+    while (n < count && p + 16 <= size) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(in + p));
+        uint32 mask = (uint32)_mm_movemask_epi8(chunk);
+
+        if (mask == 0 && n + 16 <= count) {
+            // 16 single byte values (most common case in indices) - just widen bytes to uint64
+            const __m128i z = _mm_setzero_si128();
+            __m128i w16[2] = { _mm_unpacklo_epi8(chunk, z), _mm_unpackhi_epi8(chunk, z) };
+            for (int i = 0; i < 2; ++i) {
+                __m128i w32[2] = { _mm_unpacklo_epi16(w16[i], z), _mm_unpackhi_epi16(w16[i], z) };
+                for (int j = 0; j < 2; ++j) {
+                    _mm_storeu_si128((__m128i*)(out + n), _mm_unpacklo_epi32(w32[j], z));
+                    _mm_storeu_si128((__m128i*)(out + n + 2), _mm_unpackhi_epi32(w32[j], z));
+                    n += 4;
+                }
+            }
+            p += 16;
+            continue;
+        }
+
+        // decode all values that end inside window, lengths are taken from mask
+        uint32 consumed = 0;
+        while (n < count && consumed < 16) {
+            uint32 len = detail::ctz32(~(mask >> consumed)) + 1;
+            if (consumed + len > 16)
+                break;
+            if (len > 10)
+                return 0;
+            uint64 v = 0;
+            for (uint32 i = 0; i < len; ++i)
+                v |= (uint64)(in[p + consumed + i] & 0x7f) << (7 * i);
+            out[n++] = v;
+            consumed += len;
+        }
+
+        // value crosses window boundary
+        if (consumed == 0) {
+            size_t r = varintDecode(in + p, size - p, out[n++]);
+            if (r == 0)
+                return 0;
+            consumed = (uint32)r;
+        }
+        p += consumed;
+    }
+
+    // tail
+    while (n < count) {
+        size_t r = varintDecode(in + p, size - p, out[n++]);
+        if (r == 0)
+            return 0;
+        p += r;
+    }
+    return p;
+}
+
 //- const stream
-const_stream::const_stream(stream &&s) : _data(s.data()), _size(s.size()) { }
+const_stream::const_stream(stream &&s) : _data(static_cast<const stream&>(s).data()), _size(s.size()) { }
 const_stream::const_stream(const stream &s) : _data(s.data()), _size(s.size()) { }
 const_stream::const_stream(const void *m, const size_t s) : _data(m), _size(s) { }
 const_stream::~const_stream() {}
 size_t const_stream::size() const { return _size; }
 const uint8 *const_stream::data() const { return (uint8*)_data; }
 
+//- chunk pool
+chunk_pool::chunk_pool(size_t chunkSize, size_t maxFree) : _chunkSize(chunkSize), _maxFree(maxFree) { }
+
+chunk_pool::~chunk_pool() {
+    for (auto c : _free)
+        delete [] c;
+}
+
+size_t chunk_pool::chunkSize() const { return _chunkSize; }
+
+uint8 *chunk_pool::acquire() {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (!_free.empty()) {
+            uint8 *c = _free.back();
+            _free.pop_back();
+            return c;
+        }
+    }
+    return new uint8[_chunkSize];
+}
+
+void chunk_pool::release(uint8 *chunk) {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (_free.size() < _maxFree) {
+            _free.push_back(chunk);
+            return;
+        }
+    }
+    delete [] chunk;
+}
+
+chunk_pool &chunk_pool::shared() {
+    static chunk_pool pool(64 * 1024);
+    return pool;
+}
+
+//- chunked stream
+chunked_stream::chunked_stream(chunk_pool &pool) : _pool(&pool), _size(0) { }
+
+chunked_stream::~chunked_stream() {
+    clear();
+}
+
+chunked_stream::chunked_stream(chunked_stream &&s) : _pool(s._pool), _chunks(std::move(s._chunks)), _size(s._size) {
+    s._chunks.clear();
+    s._size = 0;
+}
+
+chunked_stream &chunked_stream::operator=(chunked_stream &&s) {
+    if (this != &s) {
+        clear();
+        _pool = s._pool;
+        _chunks = std::move(s._chunks);
+        _size = s._size;
+        s._chunks.clear();
+        s._size = 0;
+    }
+    return *this;
+}
+
+size_t chunked_stream::size() const { return _size; }
+
+void chunked_stream::clear() {
+    for (auto c : _chunks)
+        _pool->release(c);
+    _chunks.clear();
+    _size = 0;
+}
+
+void chunked_stream::write(const void *data, size_t size) {
+    const size_t cs = _pool->chunkSize();
+    const uint8 *src = (const uint8*)data;
+    while (size > 0) {
+        size_t offset = _size % cs;
+        if (offset == 0 && _size == _chunks.size() * cs)
+            _chunks.push_back(_pool->acquire());
+        size_t n = std::min(size, cs - offset);
+        memcpy(_chunks.back() + offset, src, n);
+        src += n;
+        size -= n;
+        _size += n;
+    }
+}
+
+void chunked_stream::write(const chunked_stream &s) {
+    for (const auto &c : s.gather())
+        write(c.data(), c.size());
+}
+
+template <typename T> void chunked_stream::write(const T &in) {
+    write(&in, sizeof(in));
+}
+
+void chunked_stream::writeVarint(uint64 v) {
+    uint8 b[10];
+    write(b, varintEncode(v, b));
+}
+
+void chunked_stream::writeZigzag(int64 v) {
+    writeVarint(zigzagEncode(v));
+}
+
+std::vector<const_stream> chunked_stream::gather() const {
+    const size_t cs = _pool->chunkSize();
+    std::vector<const_stream> r;
+    r.reserve(_chunks.size());
+    for (size_t i = 0; i < _chunks.size(); ++i)
+        r.push_back(const_stream(_chunks[i], std::min(cs, _size - i * cs)));
+    return r;
+}
+
+stream chunked_stream::flatten() const {
+    stream r;
+    r.reserve(_size);
+    for (const auto &c : gather())
+        r.write(c.data(), c.size());
+    r.setPosFromBegin(0);
+    return r;
+}
+
 //- string conversions
 template<> inline size_t estimateSize(const stream &s) {
     return s.size();
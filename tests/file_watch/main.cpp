@@ -28,7 +28,8 @@ int main(int argc, char **argv) {
              switch (std::get<0>(c)) {
                 case fs::fileMonitorAdd: std::cout << "+ " << std::get<1>(c) << std::endl; break;
                 case fs::fileMonitorRemove: std::cout << "- " << std::get<1>(c) << std::endl; break;
-                case fs::fileMonitorModify: std::cout << "= " << std::get<1>(c) << std::endl;
+                case fs::fileMonitorModify: std::cout << "= " << std::get<1>(c) << std::endl; break;
+                case fs::fileMonitorOverflow: std::cout << "! changes lost, rescan" << std::endl;
              }
         }
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
@@ -0,0 +1,63 @@
+#include <base/base.hpp>
+
+using namespace granite;
+using namespace granite::base;
+
+// lookup latency should not depend on archive size (hash index), archive open neither (index is searched in place)
+int main(int argc, char **argv) {
+    log::init("log.txt");
+    timer::init();
+    fs::open(fs::getUserDirectory());
+    fs::preferArchives(true);
+
+    rng<> rn;
+    const size_t lookups = 200000;
+    const string content = "vfs lookup test";
+    std::vector<double> results, opens;
+
+    for (size_t filesCount : {100, 1000, 10000, 50000}) {
+        if (fs::exists("vfs_lookup_bench.gfs"))
+            fs::remove("vfs_lookup_bench.gfs");
+        fs::createArchive("vfs_lookup_bench.gfs");
+
+        std::vector<string> ids;
+        for (size_t i = 0; i < filesCount; ++i) {
+            ids.push_back(strs("vfs_lookup_bench/", i % 16, "/file_", i, ".bin"));
+            fs::store(ids.back(), const_stream(content.data(), content.size()), fs::workingDirectory, false);
+        }
+
+        // reopen, index is written on close
+        fs::close();
+        fs::open(fs::getUserDirectory());
+        fs::preferArchives(true);
+        timer to;
+        to.reset();
+        fs::initArchive("vfs_lookup_bench.gfs");
+        opens.push_back(to.timeNs());
+
+        // shuffled lookups of existing and missing files
+        std::vector<string> queries;
+        for (size_t i = 0; i < 1024; ++i)
+            queries.push_back(i % 4 == 0 ? strs("vfs_lookup_bench/", i % 16, "/missing_", i, ".bin") : *rn.pickOne(ids.begin(), ids.end()));
+
+        size_t found = 0;
+        timer t;
+        t.reset();
+        for (size_t i = 0; i < lookups; ++i)
+            found += fs::exists(queries[i % queries.size()]) ? 1 : 0;
+        double ns = t.timeNs() / lookups;
+        results.push_back(ns);
+
+        std::cout << "[info] " << filesCount << " files: " << ns << " ns per lookup (" << found << " found), open: " << opens.back() / 1000 << " us" << std::endl;
+        fs::close();
+    }
+
+    fs::remove("vfs_lookup_bench.gfs");
+    fs::close();
+
+    // 500x more files should not be much slower (linear search would be)
+    std::cout << (results.back() < results.front() * 4 ? "[ok] lookup time independent of archive size" : "[fail] lookup time grows with archive size") << std::endl;
+    std::cout << (opens.back() < opens.front() * 50 ? "[ok] open time independent of archive size" : "[fail] open time grows with archive size") << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include <base/base.hpp>
+#ifdef GE_PLATFORM_LINUX
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace granite;
+using namespace granite::base;
+
+namespace {
+const char *archive = "vfs_recovery_test.gfs";
+bool failed = false;
+
+void check(bool ok, const string &what) {
+    std::cout << (ok ? "[ok] " : "[fail] ") << what << std::endl;
+    failed = failed || !ok;
+}
+
+string content(size_t i, size_t size) {
+    string s(size, ' ');
+    for (size_t k = 0; k < size; ++k)
+        s[k] = (char)('a' + (i * 7 + k / 3) % 26);
+    return s;
+}
+
+bool equals(const stream &s, const string &e) {
+    return s.size() == e.size() && memcmp(s.data(), e.data(), e.size()) == 0;
+}
+
+// opens file system with fresh (or existing if create is not set) test archive
+void openArchive(bool create, bool journal = false) {
+    fs::open(fs::getUserDirectory());
+    fs::preferArchives(true);
+    fs::compactionBudget(0);
+    fs::journalArchives(journal);
+    if (create) {
+        if (fs::exists(archive))
+            fs::remove(archive);
+        fs::createArchive(archive);
+    }
+    else fs::initArchive(archive);
+}
+}
+
+// archive changes survive process death (journal), compaction and removal of shared data,
+// unfinished streamed writes do not touch stored files
+int main(int argc, char **argv) {
+    log::init("log.txt");
+    timer::init();
+
+    // store, process killed without close - journal is replayed on next open
+    #ifdef GE_PLATFORM_LINUX
+    openArchive(true);
+    fs::close();
+    if (fork() == 0) {
+        openArchive(false, true);
+        for (size_t i = 0; i < 100; ++i) {
+            string s = content(i, 1000 + i * 10);
+            fs::store(strs("vfs_recovery_test/file_", i, ".txt"), const_stream(s.data(), s.size()));
+        }
+        _exit(0); // no flush/close, index is not written
+    }
+    int status;
+    wait(&status);
+    openArchive(false, true);
+    size_t replayed = 0;
+    for (size_t i = 0; i < 100; ++i)
+        replayed += equals(fs::load(strs("vfs_recovery_test/file_", i, ".txt")), content(i, 1000 + i * 10)) ? 1 : 0;
+    check(replayed == 100, strs("stored files replayed after kill: ", replayed, "/100"));
+    fs::close();
+    #else
+    std::cout << "[info] kill test skipped (linux only)" << std::endl;
+    #endif
+
+    // remove, compaction moves remaining files - they load unchanged
+    openArchive(true);
+    for (size_t i = 0; i < 50; ++i) {
+        string s = content(i, 20000);
+        fs::store(strs("vfs_recovery_test/c_", i, ".bin"), const_stream(s.data(), s.size()), fs::workingDirectory, i % 2 == 0);
+    }
+    for (size_t i = 0; i < 50; i += 3)
+        fs::remove(strs("vfs_recovery_test/c_", i, ".bin"));
+    fs::compactArchive(archive);
+    fs::close();
+    openArchive(false);
+    size_t intact = 0, removed = 0;
+    for (size_t i = 0; i < 50; ++i) {
+        string id = strs("vfs_recovery_test/c_", i, ".bin");
+        if (i % 3 == 0)
+            removed += fs::exists(id) ? 0 : 1;
+        else intact += equals(fs::load(id), content(i, 20000)) ? 1 : 0;
+    }
+    check(intact == 33 && removed == 17, strs("files intact after remove and compaction: ", intact, "/33, removed: ", removed, "/17"));
+    fs::close();
+
+    // deduplicated store, removing one sharer keeps data of the other (also after compaction)
+    openArchive(true);
+    fs::deduplicateArchives(true);
+    string shared = content(1, 100000);
+    fs::store("vfs_recovery_test/shared_a.bin", const_stream(shared.data(), shared.size()));
+    fs::store("vfs_recovery_test/shared_b.bin", const_stream(shared.data(), shared.size()));
+    fs::remove("vfs_recovery_test/shared_a.bin");
+    bool sharedOk = equals(fs::load("vfs_recovery_test/shared_b.bin"), shared);
+    fs::compactArchive(archive);
+    sharedOk = sharedOk && equals(fs::load("vfs_recovery_test/shared_b.bin"), shared);
+    fs::close();
+    openArchive(false);
+    sharedOk = sharedOk && !fs::exists("vfs_recovery_test/shared_a.bin") && equals(fs::load("vfs_recovery_test/shared_b.bin"), shared);
+    check(sharedOk, "deduplicated file loads after other sharer is removed");
+    fs::deduplicateArchives(false);
+    fs::close();
+
+    // streamed write destroyed without commit - stored file is not replaced
+    openArchive(true);
+    string old = content(2, 5000);
+    fs::store("vfs_recovery_test/stream.bin", const_stream(old.data(), old.size()));
+    {
+        fs::fileWriter w = fs::create("vfs_recovery_test/stream.bin");
+        string s = content(3, 300000);
+        w.write(s.data(), s.size());
+    }
+    bool kept = equals(fs::load("vfs_recovery_test/stream.bin"), old);
+    fs::close();
+    openArchive(false);
+    kept = kept && equals(fs::load("vfs_recovery_test/stream.bin"), old);
+    check(kept, "file kept when streamed write is not committed");
+    fs::close();
+
+    fs::open(fs::getUserDirectory());
+    fs::remove(archive);
+    fs::close();
+
+    return failed ? 1 : 0;
+}